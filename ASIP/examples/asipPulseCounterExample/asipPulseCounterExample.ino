@@ -0,0 +1,43 @@
+/*    
+ * Example sketch to show how to incorporate the pulse counter service
+ * A tachometer or flow meter output is connected to pin 2 
+ * (the pin must support interrupts).
+ *
+ * C,A,100   <- send count, frequency and period every 100ms
+ * C,Z       <- reset counts to zero
+ */
+
+
+
+#include <asip.h>       // the base class definitions
+#include <asipIO.h>     // the core I/O class definition
+#include <services/asipPulseCounter.h> // edge counter and frequency measurement
+
+char const *sketchName = "asipPulseCounterExample";
+
+const byte NBR_PULSE_COUNTERS = 1; // up to MAX_PULSE_COUNTERS
+const byte pulsePins[] = {2}; // Pin to which pulse source is attached: change as appropriate
+asipCHECK_PINS(pulsePins[NBR_PULSE_COUNTERS]); //this declaration tests for correct nbr of pin initializers
+
+asipPulseCounterClass asipPulseCounter(id_PULSE_COUNTER_SERVICE);
+                 
+// make a list of the created services
+asipService services[] = { 
+                                 &asipIO, // the core class for pin level I/O
+                                 &asipPulseCounter
+				 };
+
+void setup()
+{
+  Serial.begin(57600);
+  asip.begin(&Serial, asipServiceCount(services), services, sketchName); 
+  // start the services
+  asipPulseCounter.begin(NBR_PULSE_COUNTERS, pulsePins, RISING); 
+  asipIO.begin(); // core I/O service must follow all other service begin methods
+  Serial.println("!AsipPulseCounterExample is ready");	
+}
+
+void loop() 
+{
+  asip.service();
+}
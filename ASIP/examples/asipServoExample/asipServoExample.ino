@@ -1,6 +1,13 @@
 /*    
  * Example sketch to show how to add two servos to pin
  * 3 and 4
+ *
+ * S,W,0,90              <- move servo 0 to 90 degrees immediately
+ * S,V,0,45,60           <- move servo 0 to 45 degrees at 60 degrees per second
+ * S,P,2                 <- use cosine easing for following moves
+ * S,G,1000,2,{0:0,1:180} <- move both servos, starting and finishing together after 1 second
+ * S,U,2,{1500,1725}     <- set both servos with microsecond resolution
+ * S,Q                   <- report pulse width and moving flag for each servo
  */
 
 
@@ -3,6 +3,9 @@
  * services: distance, servo, tone all included here.
  * Servo is connected to pin 3, distance to pin 4
  * and tone to pin 9.
+ *
+ * T,P,440,500                    <- play 440Hz tone for 500ms
+ * T,Q,3,{262:250,0:100,392:500}  <- queue two notes with a rest between, @T,c is sent when done 
  */
 
 
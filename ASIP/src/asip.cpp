@@ -100,6 +100,7 @@ void asipClass::service()
   // auto events for services:
   uint32_t currentTick = millis();
   for(int i=0; i < nbrServices; i++) {
+    services[i]->tick(stream);
     if( services[i]->autoInterval > 0) {  // zero disables autoInterval
       if( currentTick >= services[i]->nextTrigger )  {
          services[i]->reportValues(stream);
@@ -512,6 +513,11 @@ void asipServiceClass::begin(byte _nbrElements, serviceBeginCallback_t serviceBe
  
 asipServiceClass::~asipServiceClass(){} 
 
+// services that need background processing between requests override this
+void asipServiceClass::tick(Stream *stream)
+{
+}
+
 void asipServiceClass::reportValues(Stream *stream) 
 {
   stream->write(EVENT_HEADER);
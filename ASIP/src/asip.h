@@ -93,6 +93,13 @@ const char MSG_TERMINATOR = '\n';
 
 #define asipServiceCount(s)  (sizeof(s) / sizeof(asipService))
 
+// services with interrupt handlers use this so ISRs are placed in RAM on ESP boards
+#if defined(ESP8266) || defined(ESP32)
+#define ASIP_ISR_ATTR IRAM_ATTR
+#else
+#define ASIP_ISR_ATTR
+#endif
+
 class asipClass 
 {
 public:
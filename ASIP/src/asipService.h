@@ -36,6 +36,7 @@ public:
   virtual void reportValues(Stream *stream); // send all values separated by commas, preceded by header and terminated with newline
   virtual void setAutoreport(Stream *stream); // how many ticks between events, 0 disables 
   virtual void processRequestMsg(Stream *stream) = 0;
+  virtual void tick(Stream *stream); // called on every pass of asip.service(), override for background processing
   virtual void reportError( const char svc, const char request, asipErr_t err, Stream *stream); // report service request errors
   virtual void reportName(Stream *stream);
   virtual char getServiceId();  
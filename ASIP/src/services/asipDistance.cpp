@@ -13,18 +13,39 @@
  
 #include "asipDistance.h"
 
+// echo edge timestamps written by the ISR, only one sensor is pinged at a time
+static volatile uint32_t echoStart;
+static volatile uint32_t echoEnd;
+static volatile bool     echoDone;
+static byte isrEchoPin;
+
+static void ASIP_ISR_ATTR echoIsr()
+{
+  if(digitalRead(isrEchoPin) == HIGH) {
+     if(echoStart == 0) {
+        echoStart = micros();
+     }
+  }
+  else if(echoStart != 0) {
+     echoEnd = micros();
+     echoDone = true;
+  }
+}
 
 asipDistanceClass::asipDistanceClass(const char svcId) : asipServiceClass(svcId)
 {
    svcName = PSTR("Distance");
    i2cBus = NULL;
+   pingGap = DEFAULT_PING_GAP;
+   thresholdCallback = NULL;
 }
 
 // each sensor uses 1 pin
 void asipDistanceClass::begin(byte nbrElements, const pinArray_t pins[])
 {
   SeperateTrigEchoPins = false;
-  asipServiceClass::begin(nbrElements,pins);
+  asipServiceClass::begin(min(nbrElements,MAX_DISTANCE_SENSORS),pins);
+  reset();
 }
 
 // each sensor uses 2 pins
@@ -36,27 +57,34 @@ void asipDistanceClass::begin(byte nbrElements, const byte nbrPins, const pinArr
   else {
      SeperateTrigEchoPins = true;
   }
-  asipServiceClass::begin(nbrElements,nbrPins,pins);
+  asipServiceClass::begin(min(nbrElements,MAX_DISTANCE_SENSORS),nbrPins,pins);
+  reset();
 }
 
 // sensor uses I2C on given pins at given I2C address
-// only one I2C sensor is supported in this version (nbrElements should be 1)
-// to support more than 1 I2C sensor, code needed to accept array of sensor addresses
 // pinArray[0] is the SDA pin, pinarray[1] is SCL
 void asipDistanceClass::begin(byte nbrElements, const byte nbrPins, const pinArray_t pins[], TwoWire &I2CBus, const byte addr )
 {
-  //Serial.printf("nbr pins=%d, sda=%d, scl=%d, addr = %x\n", nbrPins,pins[0], pins[1], addr);
+  singleAddr = addr;
+  begin(1, nbrPins, pins, I2CBus, &singleAddr);
+}
+
+// one or more sensors on the same I2C bus, addrs has one address for each sensor
+void asipDistanceClass::begin(byte nbrElements, const byte nbrPins, const pinArray_t pins[], TwoWire &I2CBus, const byte addrs[] )
+{
+  //Serial.printf("nbr pins=%d, sda=%d, scl=%d, addr = %x\n", nbrPins,pins[0], pins[1], addrs[0]);
  
   i2cBus = &I2CBus;
-  i2cAddr = addr;
+  i2cAddrs = addrs;
  
-  asipServiceClass::begin(nbrElements,nbrPins,pins);
+  asipServiceClass::begin(min(nbrElements,MAX_DISTANCE_SENSORS),nbrPins,pins);
 #if defined (TARGET_RP2040) or defined (ARDUINO_ARCH_ESP32)
   i2cBus->setSDA(pins[0]);
   i2cBus->setSCL(pins[1]);
 #endif
   i2cBus->begin();
   delay(20);
+  reset();
 }
 
 // this function rewrites the pins used by this service   
@@ -83,13 +111,107 @@ void asipDistanceClass::reportName(Stream * stream)
 
  void asipDistanceClass::reset()
  {
-  
+   for(byte i=0; i < MAX_DISTANCE_SENSORS; i++) {
+      distance[i] = 0;
+      historyIndex[i] = 0;
+      for(byte j=0; j < DISTANCE_HISTORY_SIZE; j++) {
+         history[i][j] = 0;
+      }
+   }
+   if(pingState == PING_WAIT_ECHO && echoUsesInterrupt) {
+      detachInterrupt(digitalPinToInterrupt(echoPin));
+   }
+   for(byte i=0; i < MAX_DISTANCE_SENSORS; i++) {
+      nearThreshold[i] = farThreshold[i] = 0;
+   }
+   nearFlags = 0;
+   rangedFlags = 0;
+   completedSensor = -1;
+   currentSensor = 0;
+   pingState = PING_IDLE;
+   stateTime = millis();
  }
  
+void asipDistanceClass::setPingGap(unsigned int gap)
+{
+   pingGap = gap;
+}
+
+void asipDistanceClass::setFilter(distanceFilter_t mode)
+{
+   if(mode <= DISTANCE_MEAN) {
+      filterMode = mode;
+   }
+}
+
+void asipDistanceClass::setThreshold(byte sensor, int nearCm, int farCm)
+{
+   if(sensor < nbrElements) {
+      nearThreshold[sensor] = nearCm;
+      farThreshold[sensor] = max(nearCm, farCm); 
+      bitClear(nearFlags, sensor);
+   }
+}
+
+void asipDistanceClass::setThresholdCallback(distanceThresholdCallback_t callback)
+{
+   thresholdCallback = callback;
+}
+
+bool asipDistanceClass::isNear(byte sensor)
+{
+   return bitRead(nearFlags, sensor);
+}
+
+// sends an event and calls the sketch callback when a new reading crosses a threshold
+void asipDistanceClass::checkThreshold(byte sensor, Stream *stream)
+{
+   bool isValid;
+   int cm = getFilteredDistance(sensor, isValid);
+   if( nearThreshold[sensor] == 0 || !bitRead(rangedFlags, sensor)) {
+      return;
+   }
+   bool wasNear = isNear(sensor);
+   bool near = false;  // no echo or out of range is far, so an object that leaves range abruptly is not latched near
+   if( isValid) {
+      near = wasNear ? cm < farThreshold[sensor] : cm <= nearThreshold[sensor];
+   }
+   if( near != wasNear) {
+      bitWrite(nearFlags, sensor, near);
+      stream->write(EVENT_HEADER);
+      stream->write(ServiceId);
+      stream->write(',');
+      stream->write(tag_DISTANCE_THRESHOLD_EVENT);
+      stream->write(',');
+      stream->print(sensor);
+      stream->write(',');
+      stream->print(near ? 1 : 0);
+      stream->write(',');
+      stream->print(cm);
+      stream->write(MSG_TERMINATOR);
+      if( thresholdCallback) {
+         thresholdCallback(sensor, near, cm);
+      }
+   }
+}
+
+void asipDistanceClass::setContinuousRanging(bool isContinuous)
+{
+   this->isContinuous = isContinuous;
+}
+
  void asipDistanceClass::reportValue(int sequenceId, Stream * stream)  // send the value of the given device
 {
   if( sequenceId < nbrElements) {
+     if(filterMode == DISTANCE_RAW) {
        stream->print(getDistance(sequenceId));
+     }
+     else {
+       bool isValid;
+       stream->print(getFilteredDistance(sequenceId, isValid));
+       stream->write(':');
+       stream->print(isValid ? 1 : 0);
+     }
   }
 }
 
@@ -100,81 +222,244 @@ void asipDistanceClass::processRequestMsg(Stream *stream)
       setAutoreport(stream);
    }
    else if(request == tag_DISTANCE_MEASURE){ 
-      reportValues(stream);  // send a single measurement
+      reportValues(stream);  // send the most recent measurement
+   }
+   else if(request == tag_DISTANCE_PING_GAP){ 
+      setPingGap(stream->parseInt());
+   }
+   else if(request == tag_DISTANCE_CONTINUOUS){ 
+      setContinuousRanging(stream->parseInt() != 0);
+   }
+   else if(request == tag_DISTANCE_FILTER){ 
+      setFilter((distanceFilter_t)stream->parseInt());
+   }
+   else if(request == tag_DISTANCE_THRESHOLD){ 
+      int sensor = stream->parseInt();
+      int nearCm = stream->parseInt();
+      int farCm = stream->parseInt();
+      if(sensor >= nbrElements) {
+         reportError(ServiceId, request, ERR_INVALID_DEVICE_NUMBER, stream);
+      }
+      else {
+         setThreshold(sensor, nearCm, farCm);
+      }
    }
-      
+
    else {
      reportError(ServiceId, request, ERR_UNKNOWN_REQUEST, stream);
    }
 }
 
+// returns the most recent distance in cm
 int asipDistanceClass::getDistance(int sequenceId)
 {
-    if(i2cBus != NULL) {
-        return readI2CSensor(sequenceId);
-    }
-    else{
-        return readPulsedSensor(sequenceId);
+    if(sequenceId < nbrElements) {
+        return distance[sequenceId];
     } 
     else
         return 0;
 }
 
-int asipDistanceClass::readPulsedSensor(int sequenceId)
+// timeouts and missing sensors are rejected, a single spike is removed by the median 
+// the value is valid if more than half the readings in the history are valid
+int asipDistanceClass::getFilteredDistance(int sequenceId, bool &isValid)
+{
+    isValid = false;
+    if(sequenceId >= nbrElements) {
+        return 0;
+    }
+    if(filterMode == DISTANCE_RAW) {
+        isValid = distance[sequenceId] > 0;
+        return distance[sequenceId];
+    }
+    // insertion sort of the valid readings
+    int16_t sorted[DISTANCE_HISTORY_SIZE];
+    byte count = 0;
+    for(byte i=0; i < DISTANCE_HISTORY_SIZE; i++) {
+        int16_t value = history[sequenceId][i];
+        if(value > 0) {
+            byte j = count++;
+            while(j > 0 && sorted[j-1] > value) {
+                sorted[j] = sorted[j-1];
+                j--;
+            }
+            sorted[j] = value;
+        }
+    }
+    if(count == 0) {
+        return 0;
+    }
+    isValid = count > DISTANCE_HISTORY_SIZE / 2;
+    int median = sorted[count / 2];
+    if(filterMode == DISTANCE_MEDIAN) {
+        return median;
+    }
+    int sum = 0;
+    byte inliers = 0;
+    for(byte i=0; i < count; i++) {
+        if(abs(sorted[i] - median) <= DISTANCE_OUTLIER_LIMIT) {
+            sum += sorted[i];
+            inliers++;
+        }
+    }
+    return (sum + inliers / 2) / inliers; // the median is always an inlier
+}
+
+void asipDistanceClass::tick(Stream *stream)
+{
+    if(nbrElements > 0) {
+        if(i2cBus != NULL) {
+            serviceI2CSensors();
+        }
+        else {
+            servicePulsedSensors();
+        }
+        if( completedSensor >= 0) {
+            checkThreshold(completedSensor, stream);  // thresholds are independent of the autoevent rate
+            completedSensor = -1;
+        }
+    }
+}
+
+// state machine that pings sensors in turn without blocking
+void asipDistanceClass::servicePulsedSensors()
 {
-  const long MAX_DISTANCE = 100;  
-  const long MAX_DURATION =   (MAX_DISTANCE * 58);
+  switch(pingState) {
+    case PING_IDLE:
+      if( millis() - stateTime >= pingGap) {
+         startPing();
+      }
+      break;
+    case PING_TRIGGER:
+      // The sensor is triggered by a HIGH pulse of 10 or more microseconds.
+      if( micros() - stateTime >= 10) {
+         digitalWrite(trigPin, LOW);
+         pinMode(echoPin, INPUT);
+         echoStart = echoEnd = 0;
+         echoDone = false;
+         isrEchoPin = echoPin;
+         echoUsesInterrupt = digitalPinToInterrupt(echoPin) != NOT_AN_INTERRUPT;
+         if( echoUsesInterrupt) {
+            attachInterrupt(digitalPinToInterrupt(echoPin), echoIsr, CHANGE);
+         }
+         stateTime = micros();
+         pingState = PING_WAIT_ECHO;
+      }
+      break;
+    case PING_WAIT_ECHO:
+      if( !echoUsesInterrupt) {
+         echoIsr(); // poll the echo pin, resolution is limited to the loop time
+      }
+      if( echoDone) {
+         // The speed of sound is 340 m/s or 29 microseconds per centimeter.
+         // The ping travels out and back, so to find the distance of the
+         // object we take half of the distance travelled.
+         uint32_t duration = echoEnd - echoStart;
+         finishPing(duration > MAX_ECHO_DURATION ? 0 : (duration / 29) / 2);
+      }
+      else if( micros() - stateTime > ECHO_START_TIMEOUT + MAX_ECHO_DURATION) {
+         // if pulse does not arrive in this time then ping sensor may not be connected
+         finishPing(0);
+      }
+      break;
+  }
+}
 
-  // The sensor is triggered by a HIGH pulse of 2 or more microseconds.
-  // Give a short LOW pulse beforehand to ensure a clean HIGH pulse:
-   byte trigPin, echoPin;
+void asipDistanceClass::startPing()
+{
   if(SeperateTrigEchoPins){
-     int index = 2*sequenceId;
+     int index = 2*currentSensor;
      trigPin = pins[index];  
      echoPin = pins[index+1];  
   }
   else {
-    trigPin = echoPin = pins[sequenceId];    
+    trigPin = echoPin = pins[currentSensor];    
   }
   pinMode(trigPin, OUTPUT);
-  digitalWrite(trigPin, LOW);
-  delayMicroseconds(4);
-  digitalWrite(trigPin, HIGH);
-  delayMicroseconds(10);
-  digitalWrite(trigPin, LOW);
-
-  pinMode(echoPin, INPUT); 
-  
-  // limit pulseIn duration to a max of 275cm (just under 16ms) 
-  // if pulse does not arrive in this time then ping sensor may not be connected
-  // if you need to increase this then you must change the distanceSensorDataRequest message body size
-  long duration = pulseIn(echoPin, HIGH, MAX_DURATION); 
-  // convert the time into a distance
-  // The speed of sound is 340 m/s or 29 microseconds per centimeter.
-  // The ping travels out and back, so to find the distance of the
-  // object we take half of the distance travelled.
-  int cm = (duration / 29) / 2;
-  return cm;    
-}
-
-int asipDistanceClass::readI2CSensor(int sequenceId)
-{
-  // returns distance in cm or -1 if no sensor
-  i2cBus->beginTransmission(i2cAddr);
+  digitalWrite(trigPin, HIGH);  // the pin is low from the end of the previous ping
+  stateTime = micros();
+  pingState = PING_TRIGGER;
+}
+
+void asipDistanceClass::finishPing(int cm)
+{
+  if( echoUsesInterrupt) {
+     detachInterrupt(digitalPinToInterrupt(echoPin));
+  }
+  if( i2cBus == NULL && SeperateTrigEchoPins == false) {
+     pinMode(trigPin, OUTPUT);   // shared pin must be low before the next trigger
+     digitalWrite(trigPin, LOW);
+  }
+  distance[currentSensor] = cm;
+  bitSet(rangedFlags, currentSensor);
+  history[currentSensor][historyIndex[currentSensor]] = cm;
+  if( ++historyIndex[currentSensor] >= DISTANCE_HISTORY_SIZE) {
+     historyIndex[currentSensor] = 0;
+  }
+  completedSensor = currentSensor;
+  if( ++currentSensor >= nbrElements) {
+     currentSensor = 0;
+  }
+  stateTime = millis();
+  pingState = PING_IDLE;
+}
+
+// state machine that starts a conversion, then polls until the result is ready
+// only the I2C transfers take time in the loop, the conversion runs on the sensor
+void asipDistanceClass::serviceI2CSensors()
+{
+  int cm;
+  switch(pingState) {
+    case PING_IDLE:
+      if( millis() - stateTime >= pingGap) {
+         if( startI2CConversion(currentSensor)) {
+            pingState = PING_TRIGGER;
+         }
+         else {
+            finishPing(-1); // sensor not responding
+         }
+      }
+      break;
+    case PING_TRIGGER:
+      if( millis() - stateTime >= I2C_CONVERSION_TIME) {
+         pingState = PING_WAIT_ECHO;
+      }
+      break;
+    case PING_WAIT_ECHO:
+      if( readI2CSensor(currentSensor, cm)) {
+         finishPing(cm);
+         if( isContinuous) {
+            stateTime -= pingGap; // start the next conversion on the next pass
+         }
+      }
+      else if( millis() - stateTime > I2C_READY_TIMEOUT) {
+         finishPing(-1);
+      }
+      break;
+  }
+}
+
+bool asipDistanceClass::startI2CConversion(byte sensor)
+{
+  i2cBus->beginTransmission(i2cAddrs[sensor]);
   i2cBus->write(1);
-  uint8_t error = i2cBus->endTransmission(true);
-  delay(15);
+  stateTime = millis();
+  return i2cBus->endTransmission(true) == 0;
+}
+
+// returns true if the result was read, distance in cm is returned in the cm argument 
+// a sensor that is still converting does not acknowledge the read request
+bool asipDistanceClass::readI2CSensor(byte sensor, int &cm)
+{
   //Read 3 bytes from the slave
-  size_t BYTES_TO_READ = 3;
-  uint8_t bytesReceived = i2cBus->requestFrom(i2cAddr, BYTES_TO_READ);
+  const size_t BYTES_TO_READ = 3;
+  uint8_t bytesReceived = i2cBus->requestFrom(i2cAddrs[sensor], BYTES_TO_READ);
   if (bytesReceived == BYTES_TO_READ) {  //If received request nbr bytes
     uint8_t temp[BYTES_TO_READ];
     i2cBus->readBytes(temp, BYTES_TO_READ);
     uint32_t val = temp[2] + 256 * temp[1] + 256 * 256 * temp[0];
-    return (val / 1000);
+    cm = val / 1000;
+    return true;
   }
-
-  else {
-    return -1;
-  } 
-}
\ No newline at end of file
+  return false;
+}
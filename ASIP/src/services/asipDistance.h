@@ -8,6 +8,10 @@
  * version 2.1 of the License, or (at your option) any later version.
  *
  * Nov 2016- added begin option supporting seperate triger and echo pins 
+ * Ultrasonic sensors are pinged round robin from the service tick, echo edges are 
+ * timestamped in an interrupt handler and reports use the most recent reading.
+ * I2C sensors use the same round robin scheduling: a conversion is started, the sensor 
+ * is polled on later passes until the result can be read.
  */
 
 
@@ -27,9 +31,37 @@
 const char id_DISTANCE_SERVICE = 'D';
 // methods
 // enable auto events - use system define, tag_AUTOEVENT_REQUEST ('A') to request autoevents
-const char  tag_DISTANCE_MEASURE = 'M';   // measure and send a single event 
+const char  tag_DISTANCE_MEASURE = 'M';   // send a single event with the most recent measurements
+const char  tag_DISTANCE_PING_GAP = 'G';  // set minimum ms between pings to avoid crosstalk: D,G,ms
+const char  tag_DISTANCE_CONTINUOUS = 'C'; // I2C sensors: 1 starts the next conversion as soon as a result is read, 0 waits for the ping gap
+const char  tag_DISTANCE_FILTER = 'F';    // set filter mode for reported values: D,F,mode (see distanceFilter_t)
+// with filtering enabled each reported value is followed by a validity flag: @D,e,count,{cm:valid,...}
+const char  tag_DISTANCE_THRESHOLD = 'T'; // set proximity thresholds with hysteresis: D,T,sensor,nearCm,farCm  (0 disables)
+// events
+const char  tag_DISTANCE_THRESHOLD_EVENT = 't';  // sent when a threshold is crossed: @D,t,sensor,isNear,cm
 // events use system tag: SERVICE_EVENT  ('e')
 
+const byte MAX_DISTANCE_SENSORS = 4;
+const int  DEFAULT_PING_GAP     = 10;    // ms between the end of one ping and the start of the next
+const long MAX_DISTANCE         = 100;   // cm, echoes longer than this report 0
+const long MAX_ECHO_DURATION    = (MAX_DISTANCE * 58); // microseconds for the echo pulse at max distance
+const long ECHO_START_TIMEOUT   = 1000;  // microseconds allowed from trigger to start of echo pulse
+const int  I2C_CONVERSION_TIME  = 15;    // ms before an I2C sensor is first polled for its result
+const int  I2C_READY_TIMEOUT    = 50;    // ms to wait for an I2C sensor before reporting -1
+
+const byte DISTANCE_HISTORY_SIZE = 5;    // readings kept for each sensor for filtering 
+const int  DISTANCE_OUTLIER_LIMIT = 10;  // cm from the median for a reading to be included in the mean
+
+// DISTANCE_RAW reports the most recent reading, DISTANCE_MEDIAN the median of valid readings in the history 
+// DISTANCE_MEAN the mean of valid readings that are within DISTANCE_OUTLIER_LIMIT of the median
+enum distanceFilter_t {DISTANCE_RAW, DISTANCE_MEDIAN, DISTANCE_MEAN};
+
+// Callback prototype for sketches to react locally to threshold crossings 
+typedef void (*distanceThresholdCallback_t)(byte sensor, bool isNear, int cm);
+
+// I2C sensors use PING_TRIGGER for a started conversion and PING_WAIT_ECHO while polling for the result
+enum pingState_t {PING_IDLE, PING_TRIGGER, PING_WAIT_ECHO};
+
 
 class asipDistanceClass : public asipServiceClass
 {  
@@ -39,19 +71,51 @@ public:
    void begin(byte nbrElements, const pinArray_t pins[]);
    void begin(byte nbrElements, const byte nbrPins, const pinArray_t pins[]); //seperate trg and echo pins
    void begin(byte nbrElements, const byte nbrPins, const pinArray_t pins[], TwoWire &I2CBus, const byte addr ); // I2C
+   void begin(byte nbrElements, const byte nbrPins, const pinArray_t pins[], TwoWire &I2CBus, const byte addrs[] ); // I2C, one address per sensor
    void reset();
    void reportValue(int sequenceId, Stream * stream) ; // send the value of the given device
    void processRequestMsg(Stream *stream);
    void remapPins(Stream *stream);
-   int getDistance(int sequenceId);
+   int getDistance(int sequenceId);   // most recent reading 
+   int getFilteredDistance(int sequenceId, bool &isValid);  // value using the current filter mode
+   void setFilter(distanceFilter_t mode);
+   void setThreshold(byte sensor, int nearCm, int farCm); // near when <= nearCm, far again when >= farCm 
+   void setThresholdCallback(distanceThresholdCallback_t callback);
+   bool isNear(byte sensor);
+   void tick(Stream *stream);
+   void setPingGap(unsigned int gap);
+   void setContinuousRanging(bool isContinuous);
    //void reportName(Stream *stream);
 private:
 
-   int readPulsedSensor(int sequenceId);
-   int readI2CSensor(int sequenceId);
+   void startPing();
+   void servicePulsedSensors();
+   void finishPing(int cm);
+   void checkThreshold(byte sensor, Stream *stream);
+   void serviceI2CSensors();
+   bool startI2CConversion(byte sensor);
+   bool readI2CSensor(byte sensor, int &cm);
    boolean SeperateTrigEchoPins;   
+   int16_t distance[MAX_DISTANCE_SENSORS];  // most recent reading for each sensor
+   int16_t history[MAX_DISTANCE_SENSORS][DISTANCE_HISTORY_SIZE]; // ring of recent readings, values <= 0 are invalid
+   byte historyIndex[MAX_DISTANCE_SENSORS]; // where the next reading will be stored
+   distanceFilter_t filterMode;
+   int16_t nearThreshold[MAX_DISTANCE_SENSORS];
+   int16_t farThreshold[MAX_DISTANCE_SENSORS];
+   byte nearFlags;                          // bit set for each sensor that is inside its near threshold 
+   byte rangedFlags;                        // bit set for each sensor that has completed a reading since reset
+   int  completedSensor;                    // sensor with a new reading to check, -1 if none
+   distanceThresholdCallback_t thresholdCallback;
+   byte currentSensor;                      // the sensor being pinged
+   pingState_t pingState;
+   uint32_t stateTime;                      // micros at start of current ping state, or millis when idle
+   unsigned int pingGap;
+   byte trigPin, echoPin;                   // pins of the current sensor
+   bool echoUsesInterrupt;                  // false if echo pin is polled from the tick
    TwoWire *i2cBus;
-   byte i2cAddr;
+   const byte *i2cAddrs;                    // I2C address of each sensor
+   byte singleAddr;                         // storage for begin method with a single address
+   bool isContinuous;
  };
   
 extern asipDistanceClass asipDistance;
@@ -0,0 +1,154 @@
+/*
+ * asipPulseCounter.cpp -  Arduino Services Interface Protocol (ASIP)
+ *
+ * Edges are counted in interrupt handlers so high pulse rates cost the link
+ * only a few bytes per autoevent.
+ *
+ * Copyright (C) 2024 Michael Margolis
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include "asipPulseCounter.h"
+
+static pulseCounter_t counters[MAX_PULSE_COUNTERS];
+
+// keep the ISR as short as possible, all calculation is done when values are reported
+static inline void countEdge(pulseCounter_t &c)
+{
+  uint32_t now = micros();
+  uint32_t period = now - c.lastEdge;
+  if(c.count != 0) {  // the first edge has no period
+    if(period < c.minPeriod)
+      c.minPeriod = period;
+    if(period > c.maxPeriod)
+      c.maxPeriod = period;
+  }
+  c.lastEdge = now;
+  c.count++;
+}
+
+// static ISRs, one for each counter
+static void ASIP_ISR_ATTR pulseIsr0() { countEdge(counters[0]); }
+static void ASIP_ISR_ATTR pulseIsr1() { countEdge(counters[1]); }
+static void ASIP_ISR_ATTR pulseIsr2() { countEdge(counters[2]); }
+static void ASIP_ISR_ATTR pulseIsr3() { countEdge(counters[3]); }
+
+static void (*pulseIsrs[MAX_PULSE_COUNTERS])() = {pulseIsr0, pulseIsr1, pulseIsr2, pulseIsr3};
+
+asipPulseCounterClass::asipPulseCounterClass(const char svcId) : asipServiceClass(svcId)
+{
+   svcName = PSTR("Pulse Counter");
+}
+
+void asipPulseCounterClass::begin(byte nbrElements, const pinArray_t pins[])
+{
+  begin(nbrElements, pins, RISING);
+}
+
+// each counter uses 1 pin, pins must be interrupt capable
+void asipPulseCounterClass::begin(byte nbrElements, const pinArray_t pins[], int edgeMode)
+{
+  nbrElements = min(nbrElements, MAX_PULSE_COUNTERS);
+  asipServiceClass::begin(nbrElements,pins);
+  resetCounts();
+  for(byte i=0; i < nbrElements; i++) {
+     pinMode(pins[i], INPUT_PULLUP);
+     attachInterrupt(digitalPinToInterrupt(pins[i]), pulseIsrs[i], edgeMode);
+     verbose_printf("Pulse counter %d attached to pin %d\n", i, pins[i]);
+  }
+}
+
+void asipPulseCounterClass::reset()
+{
+  resetCounts();
+}
+
+void asipPulseCounterClass::resetCounts()
+{
+  uint32_t now = micros();
+  noInterrupts();
+  for(byte i=0; i < MAX_PULSE_COUNTERS; i++) {
+     counters[i].count = counters[i].prevCount = 0;
+     counters[i].lastEdge = counters[i].prevEdge = now;
+     counters[i].minPeriod = 0xFFFFFFFF;
+     counters[i].maxPeriod = 0;
+  }
+  interrupts();
+}
+
+uint32_t asipPulseCounterClass::getCount(int sequenceId)
+{
+  uint32_t value = 0;
+  if( sequenceId < nbrElements) {
+     noInterrupts();
+     value = counters[sequenceId].count;
+     interrupts();
+  }
+  return value;
+}
+
+// takes a snapshot of the ISR data and calculates the values for this report
+void asipPulseCounterClass::reportValues(Stream *stream)
+{
+  for(byte i=0; i < nbrElements; i++) {
+     pulseCounter_t &c = counters[i];
+     noInterrupts();
+     uint32_t edgeCount = c.count;
+     uint32_t lastEdge  = c.lastEdge;
+     uint32_t minP      = c.minPeriod;
+     uint32_t maxP      = c.maxPeriod;
+     c.minPeriod = 0xFFFFFFFF;
+     c.maxPeriod = 0;
+     interrupts();
+     uint32_t edges = edgeCount - c.prevCount;
+     uint32_t span  = lastEdge - c.prevEdge;  // time between the last edge of the previous report and the most recent edge
+     if( edges > 0 && span > 0) {
+        period[i] = span / edges;
+        frequency[i] = (uint32_t)((edges * 1000000.0) / span + 0.5);
+     }
+     else {
+        period[i] = frequency[i] = 0;  // no edges since previous report
+     }
+     minPeriod[i] = (minP == 0xFFFFFFFF) ? 0 : minP;
+     maxPeriod[i] = maxP;
+     count[i] = edgeCount;
+     c.prevCount = edgeCount;
+     c.prevEdge = lastEdge;
+  }
+  asipServiceClass::reportValues(stream);
+}
+
+void asipPulseCounterClass::reportValue(int sequenceId, Stream * stream)  // send the value of the given device
+{
+  if( sequenceId < nbrElements) {
+     stream->print(count[sequenceId]);
+     stream->write(':');
+     stream->print(frequency[sequenceId]);
+     stream->write(':');
+     stream->print(period[sequenceId]);
+     stream->write(':');
+     stream->print(minPeriod[sequenceId]);
+     stream->write(':');
+     stream->print(maxPeriod[sequenceId]);
+  }
+}
+
+void asipPulseCounterClass::processRequestMsg(Stream *stream)
+{
+   int request = stream->read();
+   if( request == tag_AUTOEVENT_REQUEST) {
+      setAutoreport(stream);
+   }
+   else if(request == tag_PULSE_MEASURE){
+      reportValues(stream);  // send a single measurement
+   }
+   else if(request == tag_PULSE_RESET_COUNTS){
+      resetCounts();
+   }
+   else {
+     reportError(ServiceId, request, ERR_UNKNOWN_REQUEST, stream);
+   }
+}
@@ -0,0 +1,67 @@
+/*
+ * asipPulseCounter.h -  Arduino Services Interface Protocol (ASIP)
+ *
+ * Counts edges on interrupt capable pins and reports count, frequency and period
+ * Useful for tachometers, flow meters and IR beacons
+ *
+ * Copyright (C) 2024 Michael Margolis
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+
+#ifndef asipPulseCounter_h
+#define asipPulseCounter_h
+
+#include "asip.h"
+
+// Service and method defines
+// Service IDs must be unique across all services
+// Method and event IDs must be unique within a service
+
+// ID used:  ABCDEGHILMNPRST
+
+// Pulse counter service
+const char id_PULSE_COUNTER_SERVICE = 'C';
+// methods
+// enable auto events - use system define, tag_AUTOEVENT_REQUEST ('A') to request autoevents
+const char tag_PULSE_MEASURE      = 'M';   // send a single event
+const char tag_PULSE_RESET_COUNTS = 'Z';   // set all counts to zero
+// events use system tag: SERVICE_EVENT  ('e')
+// event format: @C,e,nbrCounters,{count:frequency:period:minPeriod:maxPeriod,...}
+//   frequency is in Hz, periods are in microseconds measured over the interval since the previous report
+
+const byte MAX_PULSE_COUNTERS = 4;  // each counter needs its own ISR, increase this and add ISRs if more are needed
+
+typedef struct {
+   volatile uint32_t count;         // total edges since begin or reset
+   volatile uint32_t lastEdge;      // micros time of most recent edge
+   volatile uint32_t minPeriod;     // shortest period since previous report
+   volatile uint32_t maxPeriod;     // longest period since previous report
+   uint32_t prevCount;              // count at previous report
+   uint32_t prevEdge;               // lastEdge at previous report
+} pulseCounter_t;
+
+class asipPulseCounterClass : public asipServiceClass
+{
+public:
+   asipPulseCounterClass(const char svcId);
+   void begin(byte nbrElements, const pinArray_t pins[]);  // counts rising edges
+   void begin(byte nbrElements, const pinArray_t pins[], int edgeMode); // edgeMode is RISING, FALLING or CHANGE
+   void reset();
+   void reportValues(Stream *stream);
+   void reportValue(int sequenceId, Stream * stream) ; // send the value of the given device
+   void processRequestMsg(Stream *stream);
+   uint32_t getCount(int sequenceId);
+   void resetCounts();
+private:
+   uint32_t frequency[MAX_PULSE_COUNTERS];    // values calculated for the current report
+   uint32_t period[MAX_PULSE_COUNTERS];
+   uint32_t minPeriod[MAX_PULSE_COUNTERS];
+   uint32_t maxPeriod[MAX_PULSE_COUNTERS];
+   uint32_t count[MAX_PULSE_COUNTERS];
+};
+
+#endif
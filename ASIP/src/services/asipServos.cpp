@@ -10,6 +10,11 @@
  
 #include "asipServos.h"
 
+static inline uint16_t angleToPulse(int angle)
+{
+   return map(constrain(angle,0,180), 0, 180, MIN_PULSE_WIDTH, MAX_PULSE_WIDTH);
+}
+
 asipServoClass::asipServoClass(const char svcId, const char evtId)
   :asipServiceClass(svcId)
 {
@@ -22,20 +27,29 @@ asipServoClass::asipServoClass(const char svcId, const char evtId)
   //each servo uses one so pinCount equals nbrElements 
   asipServiceClass::begin(nbrElements,nbrElements,pins);
   myServoPtr = servoPtr; 
+  profile = SERVO_LINEAR;
   for(int i=0; i < nbrElements; i++) {     
      myServoPtr[i].attach(pins[i]);
      verbose_printf("Attaching servo id %d to pin %d\n", i, pins[i]);
+     if( i < MAX_ASIP_SERVOS) {
+        moves[i].pulseWidth = myServoPtr[i].readMicroseconds();  // the position set by attach
+        moves[i].isMoving = false;
+     }
    }
 }
 
 void asipServoClass::reportValue(int sequenceId, Stream * stream)  // send the value of the given device
 {
-   // this class does not report
+   if( sequenceId < nbrElements) {
+      stream->print(readMicroseconds(sequenceId));
+      stream->write(':');
+      stream->print(isMoving(sequenceId) ? 1 : 0);
+   }
 }
 
  void asipServoClass::reportValues(Stream *stream)
 {
-  // this class does not report
+   asipServiceClass::reportValues(stream);
 }
  
  /*
@@ -50,9 +64,191 @@ void asipServoClass::write(byte servoId, byte angle)
    if(servoId < nbrElements){
        angle = constrain(angle,0,180);
        myServoPtr[servoId].write(angle);
+       if( servoId < MAX_ASIP_SERVOS) {
+          moves[servoId].pulseWidth = angleToPulse(angle);
+          moves[servoId].isMoving = false;  // a direct write cancels any move in progress
+       }
        verbose_printf("Servo id %d on pin %d moving to %d degrees\n", servoId, pins[servoId], angle);
    }
 }
+
+void asipServoClass::writeMicroseconds(byte servoId, int pulseWidth)
+{
+   if(servoId < nbrElements){
+       pulseWidth = constrain(pulseWidth, MIN_PULSE_WIDTH, MAX_PULSE_WIDTH);
+       myServoPtr[servoId].writeMicroseconds(pulseWidth);
+       if( servoId < MAX_ASIP_SERVOS) {
+          moves[servoId].pulseWidth = pulseWidth;
+          moves[servoId].isMoving = false;
+       }
+   }
+}
+
+int asipServoClass::readMicroseconds(byte servoId)
+{
+   if( servoId < MAX_ASIP_SERVOS) {
+      return moves[servoId].pulseWidth;
+   }
+   else if(servoId < nbrElements) {
+      return myServoPtr[servoId].readMicroseconds();
+   }
+   return 0;
+}
+
+// sets servos 0 to count-1 from a single request
+void asipServoClass::writeAll(Stream *stream, bool isBinary)
+{
+   int count = stream->parseInt();
+   if( count > nbrElements) {
+      reportError(ServiceId, isBinary ? tag_SERVO_WRITE_BINARY : tag_SERVO_WRITE_US, ERR_INVALID_DEVICE_NUMBER, stream);
+      return;
+   }
+   if( isBinary) {
+      if (stream->read() == ',') {
+         for(int i=0; i < count; i++) {
+            uint8_t buf[2];
+            if( stream->readBytes(buf, 2) != 2) {
+               break;  // timed out
+            }
+            writeMicroseconds(i, buf[0] + (buf[1] << 8));
+         }
+      }
+   }
+   else if (stream->read() == ',' && stream->read() == '{') { // skip to start of parms
+      for(int i=0; i < count; i++) {
+         writeMicroseconds(i, stream->parseInt());
+      }
+   }
+}
+
+void asipServoClass::setProfile(servoProfile_t profile)
+{
+   if( profile <= SERVO_COSINE) {
+      this->profile = profile;
+   }
+}
+
+void asipServoClass::startMove(byte servoId, byte angle, uint32_t duration, uint32_t startTime)
+{
+   servoMove_t &move = moves[servoId];
+   move.startPulse = move.pulseWidth;
+   move.targetPulse = angleToPulse(angle);
+   move.startTime = startTime;
+   move.duration = duration;
+   move.isMoving = true;
+   verbose_printf("Servo id %d moving from %dus to %dus in %lu ms\n", servoId, move.startPulse, move.targetPulse, (unsigned long)duration);
+}
+
+// starts a non-blocking move, the position is updated from the service tick
+void asipServoClass::moveTo(byte servoId, byte angle, uint32_t duration)
+{
+   if(servoId < nbrElements && servoId < MAX_ASIP_SERVOS) {
+       startMove(servoId, angle, duration, millis());
+   }
+}
+
+void asipServoClass::moveAtSpeed(byte servoId, byte angle, unsigned int degreesPerSecond)
+{
+   if(servoId < nbrElements && servoId < MAX_ASIP_SERVOS && degreesPerSecond > 0) {
+       // convert the pulse width change to degrees to get the duration 
+       unsigned long distance = abs((int)angleToPulse(angle) - moves[servoId].pulseWidth) * 180UL / (MAX_PULSE_WIDTH - MIN_PULSE_WIDTH);
+       moveTo(servoId, angle, (distance * 1000UL) / degreesPerSecond);
+   }
+}
+
+bool asipServoClass::isMoving(byte servoId)
+{
+   return servoId < MAX_ASIP_SERVOS && moves[servoId].isMoving;
+}
+
+// returns the pulse width for the given elapsed time using the current profile
+int asipServoClass::easedPulse(servoMove_t &move, uint32_t elapsed)
+{
+   float f = (float)elapsed / move.duration; // fraction of time elapsed, 0 to 1
+   if( profile == SERVO_COSINE) {
+      f = (1.0 - cos(PI * f)) / 2.0;
+   }
+   else if( profile == SERVO_TRAPEZOID) {
+      // accelerate for the first quarter, constant speed, decelerate for the last quarter
+      const float ramp = 0.25;
+      const float vMax = 1.0 / (1.0 - ramp);
+      if( f < ramp)
+         f = 0.5 * vMax * f * f / ramp;
+      else if( f <= 1.0 - ramp)
+         f = vMax * (f - ramp / 2);
+      else
+         f = 1.0 - 0.5 * vMax * (1.0 - f) * (1.0 - f) / ramp;
+   }
+   return move.startPulse + (int)(((int)move.targetPulse - move.startPulse) * f + (f >= 0 ? 0.5 : -0.5));
+}
+
+// updates servos that are moving and sends an event listing servos that completed their move
+void asipServoClass::tick(Stream *stream)
+{
+   uint32_t now = millis();
+   if( now - prevTick < SERVO_TICK_INTERVAL) {
+      return;
+   }
+   prevTick = now;
+   byte done[MAX_ASIP_SERVOS];
+   byte doneCount = 0;
+   for(byte i=0; i < nbrElements && i < MAX_ASIP_SERVOS; i++) {
+      servoMove_t &move = moves[i];
+      if( move.isMoving) {
+         uint32_t elapsed = now - move.startTime;
+         int pulseWidth;
+         if( elapsed >= move.duration) {
+            pulseWidth = move.targetPulse;
+            move.isMoving = false;
+            done[doneCount++] = i;
+         }
+         else {
+            pulseWidth = easedPulse(move, elapsed);
+         }
+         if( pulseWidth != move.pulseWidth) {
+            move.pulseWidth = pulseWidth;
+            myServoPtr[i].writeMicroseconds(pulseWidth);
+         }
+      }
+   }
+   if( doneCount > 0) {
+      stream->write(EVENT_HEADER);
+      stream->write(ServiceId);
+      stream->write(',');
+      stream->write(tag_SERVO_MOVE_DONE);
+      stream->write(',');
+      stream->print(doneCount);
+      stream->write(',');
+      stream->write('{');
+      for(byte i=0; i < doneCount; i++) {
+         stream->print(done[i]);
+         if( i < doneCount-1)
+            stream->write(',');
+      }
+      stream->write('}');
+      stream->write(MSG_TERMINATOR);
+   }
+}
+
+// all servos in the group share the start time and duration so they finish together
+void asipServoClass::groupMove(Stream *stream)
+{
+   uint32_t duration = stream->parseInt();
+   int count = stream->parseInt();
+   uint32_t startTime = millis();
+   if (stream->read() == ',' && stream->read() == '{') { // skip to start of parms
+      while (count-- > 0) {
+         int servoId = stream->parseInt();
+         int angle = stream->parseInt();
+         if(servoId < nbrElements && servoId < MAX_ASIP_SERVOS) {
+            startMove(servoId, angle, duration, startTime);
+         }
+         else {
+            reportError(ServiceId, tag_SERVO_GROUP_MOVE, ERR_INVALID_DEVICE_NUMBER, stream);
+         }
+      }
+   }
+}
    
 // this function rewrites the pins used by this service   
 void asipServoClass::remapPins(Stream *stream)
@@ -81,7 +277,9 @@ void asipServoClass::remapPins(Stream *stream)
  
 void asipServoClass::reset()
 {
-
+   for(byte i=0; i < MAX_ASIP_SERVOS; i++) {
+      moves[i].isMoving = false;  // servos stay at their current position
+   }
 }
  
 void asipServoClass::processRequestMsg(Stream *stream)
@@ -104,6 +302,38 @@ void asipServoClass::processRequestMsg(Stream *stream)
         }               
      }
    } 
+   else if(request == tag_SERVO_MOVE_SPEED || request == tag_SERVO_MOVE_TIME) {
+      int servoId = stream->parseInt();
+      int angle = stream->parseInt();
+      long arg = stream->parseInt();  // degrees per second or duration
+      if(servoId >= nbrElements || servoId >= MAX_ASIP_SERVOS) {
+         reportError(ServiceId, request, ERR_INVALID_DEVICE_NUMBER, stream);
+      }
+      else if(request == tag_SERVO_MOVE_SPEED) {
+         moveAtSpeed(servoId, angle, constrain(arg, 0L, 65535L));
+      }
+      else {
+         moveTo(servoId, angle, arg);
+      }
+   }
+   else if(request == tag_SERVO_WRITE_US) {
+      writeAll(stream, false);
+   }
+   else if(request == tag_SERVO_WRITE_BINARY) {
+      writeAll(stream, true);
+   }
+   else if(request == tag_SERVO_GET_STATE) {
+      reportValues(stream);
+   }
+   else if(request == tag_AUTOEVENT_REQUEST) {
+      setAutoreport(stream);
+   }
+   else if(request == tag_SERVO_GROUP_MOVE) {
+      groupMove(stream);
+   }
+   else if(request == tag_SERVO_PROFILE) {
+      setProfile((servoProfile_t)stream->parseInt());
+   }
    else if( request == tag_REMAP_PIN_REQUEST) {
        remapPins(stream);
    }
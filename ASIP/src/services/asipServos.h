@@ -29,7 +29,33 @@
 // Servo service
 const char id_SERVO_SERVICE = 'S';
 // methods
-const char tag_SERVO_WRITE = 'W';
+const char tag_SERVO_WRITE      = 'W';  // move immediately to the given angle
+const char tag_SERVO_MOVE_SPEED = 'V';  // move to angle at the given degrees per second: S,V,id,angle,dps
+const char tag_SERVO_MOVE_TIME  = 'T';  // move to angle in the given milliseconds: S,T,id,angle,duration
+const char tag_SERVO_GROUP_MOVE = 'G';  // start and finish together: S,G,duration,count,{id:angle,...}
+const char tag_SERVO_PROFILE    = 'P';  // set easing profile used for moves: S,P,profile
+const char tag_SERVO_WRITE_US   = 'U';  // set servos 0 to count-1 in microseconds: S,U,count,{us,us,...}
+const char tag_SERVO_WRITE_BINARY = 'B'; // as above with pulse widths packed: S,B,count,<2 bytes per servo, LSB first>
+const char tag_SERVO_GET_STATE  = 'Q';  // send a single event with the state of all servos
+// enable auto events - use system define, tag_AUTOEVENT_REQUEST ('A') to request autoevents
+// events
+const char tag_SERVO_MOVE_DONE  = 'c';  // sent when moves complete: @S,c,count,{id,...}
+// servo state events use system tag: SERVICE_EVENT ('e'): @S,e,count,{microseconds:isMoving,...}
+
+enum servoProfile_t {SERVO_LINEAR, SERVO_TRAPEZOID, SERVO_COSINE};
+
+const byte MAX_ASIP_SERVOS = 8;        // the number of servos that can have moves in progress
+const byte SERVO_TICK_INTERVAL = 20;   // ms between position updates, matches the servo refresh rate
+
+// positions are stored as pulse widths so moves and state have microsecond resolution
+typedef struct {
+   uint32_t startTime;   // millis when the move started
+   uint32_t duration;    // ms to complete the move, slow moves can take more than 65 seconds
+   uint16_t startPulse;
+   uint16_t targetPulse;
+   uint16_t pulseWidth;  // most recent pulse width written to the servo
+   bool     isMoving;
+} servoMove_t;
 
    
 class asipServoClass : public asipServiceClass
@@ -41,9 +67,23 @@ public:
    void reportValues(Stream * stream);
    void reportValue(int sequenceId, Stream * stream) ; // send the value of the given device   
    void processRequestMsg(Stream *stream); 
+   void tick(Stream *stream);
    //void reportName(Stream *stream);   
+   void moveTo(byte servoId, byte angle, uint32_t duration); // non-blocking move using the current profile
+   void moveAtSpeed(byte servoId, byte angle, unsigned int degreesPerSecond);
+   bool isMoving(byte servoId);
+   void setProfile(servoProfile_t profile);
+   void writeMicroseconds(byte servoId, int pulseWidth);
+   int  readMicroseconds(byte servoId);
 private: 
    void write(byte servoId, byte angle);
+   void startMove(byte servoId, byte angle, uint32_t duration, uint32_t startTime);
+   void groupMove(Stream *stream);
+   void writeAll(Stream *stream, bool isBinary);
+   int  easedPulse(servoMove_t &move, uint32_t elapsed);
+   servoMove_t moves[MAX_ASIP_SERVOS];
+   servoProfile_t profile;
+   uint32_t prevTick;
    Servo *myServoPtr;
    void remapPins(Stream *stream);
 };   
@@ -2,6 +2,8 @@
  * asipTone.cpp -  Arduino Services Interface Protocol (ASIP)
  * tone requests are non-blocking, services should delay for the desired
  * interval between sequences of tones.
+ * Sequences of notes can be queued, or a score stored in the sketch can be played,
+ * the next note is started from the service tick.
  * 
  * Copyright (C) 2015 Michael Margolis
  * This library is free software; you can redistribute it and/or
@@ -16,6 +18,8 @@
   :asipServiceClass(svcId)
 {
   svcName = PSTR("Tone");
+  scores = NULL;
+  nbrScores = 0;
 }
 
 void asipToneClass::begin(int pin)
@@ -25,8 +29,103 @@ void asipToneClass::begin(int pin)
 }
 
 void asipToneClass::reset()
+{
+   stop();
+}
+
+void asipToneClass::stop()
 {
    noTone(speakerPin);
+   head = count = 0;
+   score = NULL;
+   playing = false;
+}
+
+bool asipToneClass::isPlaying()
+{
+   return playing;
+}
+
+bool asipToneClass::queueNote(uint16_t frequency, uint16_t duration)
+{
+   if( count >= MAX_QUEUED_NOTES) {
+      return false;
+   }
+   note_t &note = queue[(head + count) % MAX_QUEUED_NOTES];
+   note.frequency = frequency;
+   note.duration = duration;
+   count++;
+   return true;
+}
+
+void asipToneClass::setScores(const int16_t **scores, byte nbrScores)
+{
+   this->scores = scores;
+   this->nbrScores = nbrScores;
+}
+
+// score is played after any queued notes
+void asipToneClass::playScore(const int16_t *score, int tempo)
+{
+   if( tempo > 0) {
+      this->score = score;
+      scoreIndex = 0;
+      wholeNote = (60000L * 4) / tempo;
+   }
+}
+
+// gets the next note from the queue or score, returns false if there are no more notes
+bool asipToneClass::nextNote(note_t &note)
+{
+   if( count > 0) {
+      note = queue[head];
+      head = (head + 1) % MAX_QUEUED_NOTES;
+      count--;
+      return true;
+   }
+   if( score != NULL) {
+      while( score[scoreIndex] != TONE_SCORE_END) {
+         int frequency = score[scoreIndex];
+         int divider = score[scoreIndex + 1];
+         scoreIndex += 2;
+         if( frequency == TONE_SCORE_SECTION || divider == 0) {
+            continue; // skip section tags and notes with no length
+         }
+         note.frequency = frequency == TONE_REST ? 0 : frequency;
+         uint32_t duration = wholeNote / abs(divider);
+         if( divider < 0) {
+            duration += duration / 2; // dotted notes are one and a half times longer
+         }
+         note.duration = duration > 65535UL ? 65535 : duration;
+         return true;
+      }
+      score = NULL;
+   }
+   return false;
+}
+
+void asipToneClass::tick(Stream *stream)
+{
+   if( playing && millis() - noteStart < noteDuration) {
+      return;
+   }
+   note_t note;
+   if( nextNote(note)) {
+      if( note.frequency > 0) {
+         tone(speakerPin, note.frequency, (note.duration * 9UL) / 10); // allow 10% pause between notes
+      }
+      noteStart = millis();
+      noteDuration = note.duration;
+      playing = true;
+   }
+   else if( playing) {
+      playing = false;
+      stream->write(EVENT_HEADER);
+      stream->write(ServiceId);
+      stream->write(',');
+      stream->write(tag_NOTES_DONE);
+      stream->write(MSG_TERMINATOR);
+   }
 }
 
 void asipToneClass::reportValues(Stream * stream)
@@ -47,7 +146,35 @@ void asipToneClass::processRequestMsg(Stream *stream)
       if( frequency > 0 && duration > 0){
           tone(speakerPin, frequency, duration);
       }      
-   }     
+   }
+   else if( request == tag_QUEUE_NOTES) {
+      int notes = stream->parseInt();
+      if (stream->read() == ',' && stream->read() == '{') { // skip to start of parms
+         while( notes-- > 0) {
+            int frequency = stream->parseInt();
+            int duration = stream->parseInt();
+            if( duration > 0 && !queueNote(frequency, duration)) {
+               debug_printf("tone queue is full\n");
+            }
+         }
+      }
+   }
+   else if( request == tag_PLAY_SCORE) {
+      int index = stream->parseInt();
+      int tempo = stream->parseInt();
+      if( index >= 0 && index < nbrScores) {
+         playScore(scores[index], tempo);
+      }
+      else {
+         reportError(ServiceId, request, ERR_INVALID_DEVICE_NUMBER, stream);
+      }
+   }
+   else if( request == tag_STOP_NOTES) {
+      stop();
+   }
+   else {
+      reportError(ServiceId, request, ERR_UNKNOWN_REQUEST, stream);
+   }
 }
  
 
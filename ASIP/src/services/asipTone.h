@@ -24,6 +24,24 @@
 const char id_TONE_SERVICE = 'T';
 // methods
 const char tag_PLAY = 'P';            // play tone of given frequency and duration
+const char tag_QUEUE_NOTES = 'Q';     // add notes to the queue: T,Q,count,{frequency:duration,...}  frequency 0 is a rest
+const char tag_PLAY_SCORE  = 'S';     // play a score stored in the sketch: T,S,scoreIndex,tempo
+const char tag_STOP_NOTES  = 'X';     // stop playing and clear the queue
+// events
+const char tag_NOTES_DONE  = 'c';     // sent when the queue or score has finished: @T,c
+
+// score format used by the PlayMelody helper: pairs of note frequency and divider 
+// (4 is a quarter note, negative values are dotted notes, notes with a divider of 0 are skipped)
+const int16_t TONE_REST          = 1;
+const int16_t TONE_SCORE_SECTION = 0;   // section markers are skipped when a score is played
+const int16_t TONE_SCORE_END     = -1;
+
+const byte MAX_QUEUED_NOTES = 32;
+
+typedef struct {
+   uint16_t frequency;
+   uint16_t duration;  // ms
+} note_t;
 
 class asipToneClass : public asipServiceClass
 {  
@@ -34,8 +52,25 @@ public:
    void reportValues(Stream * stream);
    void reportValue(int sequenceId, Stream * stream) ; // not used in this service  
    void processRequestMsg(Stream *stream);  
+   void tick(Stream *stream);
+   bool queueNote(uint16_t frequency, uint16_t duration); // returns false if queue is full
+   void setScores(const int16_t **scores, byte nbrScores); // scores that can be played by request
+   void playScore(const int16_t *score, int tempo);
+   void stop();
+   bool isPlaying();
 private: 
+    bool nextNote(note_t &note);
     int speakerPin;
+    note_t queue[MAX_QUEUED_NOTES];
+    byte head, count;                 // queue position and number of notes queued 
+    const int16_t *score;             // score being played, NULL if none
+    int scoreIndex;
+    uint32_t wholeNote;               // ms for a whole note at the score tempo, slow tempos need more than 16 bits
+    const int16_t **scores;
+    byte nbrScores;
+    bool playing;
+    uint32_t noteStart;
+    uint16_t noteDuration;
 };   
 
 extern asipToneClass asipTone;
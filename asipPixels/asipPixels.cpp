@@ -7,6 +7,9 @@
  * License as published by the Free Software Foundation; either
  * version 2.1 of the License, or (at your option) any later version.
  *  
+ * Setting a pixel marks its strip as changed, strips are shown once at the end
+ * of a request (or at most at the refresh rate) rather than after every pixel 
+ * because show() sends the whole strip with interrupts disabled.
  */
 
 #include "asipPixels.h"
@@ -18,6 +21,11 @@ asipPixelsClass::asipPixelsClass(const char svcId, const char evtId)
   : asipServiceClass(svcId) {
   svcName = PSTR("Pixels");
   setColorCallback = nullptr;
+  changedStrips = 0;
+  isImmediateShow = false;
+  isInRequest = false;
+  refreshInterval = 0;
+  prevShowMillis = 0;
 }
 
 void asipPixelsClass::begin(byte pin, Adafruit_NeoPixel* strip) {
@@ -65,6 +73,7 @@ void asipPixelsClass::reportValue(int sequenceId, Stream* stream)  // send the v
 
 void asipPixelsClass::processRequestMsg(Stream* stream) {
   int request = stream->read();
+  isInRequest = true;
   stream->print("processing request "); stream->write(request); stream->println();
   if (request == tag_SET_PIXELS) {
     //Comma separated pairs of colon separated pixel positions and color values
@@ -179,6 +188,8 @@ void asipPixelsClass::processRequestMsg(Stream* stream) {
     {
       debug_printf("pixel strip %d is out of range\n", index);
     }
+  } else if (request == tag_SET_REFRESH_RATE) {
+    setRefreshRate(stream->parseInt());
   } else if (request == tag_CLEAR_ALL_PIXELS) {
     int index = stream->parseInt();
     if (index < nbrStrips) {
@@ -196,6 +207,8 @@ void asipPixelsClass::processRequestMsg(Stream* stream) {
     ;  // skip to end of line
 
   stripIndex = 0;  // set index back to default
+  isInRequest = false;
+  update();  // all pixels changed by the request are shown together
 }
 
 // enable calling from sketch to control strip 0
@@ -203,7 +216,7 @@ void asipPixelsClass::setPixelColor(int pixel, uint32_t color) {
   debug_printf("in func, set pixel %d to hex %x\n", pixel, color);
   if (stripPtr && stripIndex < nbrStrips) {
     stripPtr[stripIndex].setPixelColor(pixel, color);
-    stripPtr[stripIndex].show();
+    markChanged();
   }
   if (setColorCallback) {
     uint8_t R = ((color >> 16) & 0xFF);
@@ -218,7 +231,7 @@ void asipPixelsClass::setPixelColor(int pixel, uint8_t r, uint8_t g, uint8_t b)
   debug_printf("in func, set pixel %d to %d,%d,%d\n", pixel, r, g, b);
   if (stripPtr && stripIndex < nbrStrips) {
     stripPtr[stripIndex].setPixelColor(pixel, r, g, b);
-    stripPtr[stripIndex].show();
+    markChanged();
   }
   if (setColorCallback) {
     setColorCallback(r, g, b);
@@ -230,7 +243,7 @@ void asipPixelsClass::setBrightness(int brightness)  // ignored if no strip
   if (stripPtr && stripIndex < nbrStrips) {
     // sets overall strip brightness, 255 is max
     stripPtr[stripIndex].setBrightness(brightness);
-    stripPtr[stripIndex].show();
+    markChanged();
   }
 }
 
@@ -238,9 +251,48 @@ void asipPixelsClass::clear() {
   if (stripPtr && stripIndex < nbrStrips) {
     // sets overall strip brightness, 255 is max
     stripPtr[stripIndex].clear();
-    stripPtr[stripIndex].show();
+    markChanged();
   }
   if (setColorCallback) {
     setColorCallback(0, 0, 0);
   }
 }
+
+void asipPixelsClass::markChanged() {
+  if ((isImmediateShow && !isInRequest) || stripIndex >= MAX_DEFERRED_STRIPS) {
+    stripPtr[stripIndex].show();
+  } else {
+    changedStrips |= (1UL << stripIndex);
+  }
+}
+
+void asipPixelsClass::tick(Stream* stream) {
+  update();
+}
+
+void asipPixelsClass::update() {
+  if (changedStrips && (refreshInterval == 0 || millis() - prevShowMillis >= refreshInterval)) {
+    show();
+  }
+}
+
+void asipPixelsClass::show() {
+  for (int i = 0; i < nbrStrips && changedStrips; i++) {
+    if (changedStrips & (1UL << i)) {
+      stripPtr[i].show();
+      changedStrips &= ~(1UL << i);
+    }
+  }
+  prevShowMillis = millis();
+}
+
+void asipPixelsClass::setRefreshRate(int hz) {
+  refreshInterval = hz > 0 ? 1000 / hz : 0;
+}
+
+void asipPixelsClass::setImmediateShow(bool isImmediate) {
+  isImmediateShow = isImmediate;
+  if (isImmediate) {
+    show();
+  }
+}
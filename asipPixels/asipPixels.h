@@ -34,6 +34,7 @@ const char tag_SET_PIXEL_SEQUENCE_RGB = 's';
 const char tag_SET_BRIGHTNESS         = 'B';
 const char tag_GET_NUMBER_PIXELS      = 'I';
 const char tag_CLEAR_ALL_PIXELS       = 'C';
+const char tag_SET_REFRESH_RATE       = 'R';  // maximum strip updates per second, 0 updates at the end of every request
 
 // Colors are the RGB  8 bit values packed into a 32 bit integer as follows:
 //      Color = r <<16  +  g <<8  +  b
@@ -45,6 +46,8 @@ const char tag_CLEAR_ALL_PIXELS       = 'C';
 // friendly defines for default strip configuration
 #define defaultStripType (NEO_RGB + NEO_KHZ800)
 
+const byte MAX_DEFERRED_STRIPS = 32;  // strips beyond this are shown as each pixel is set
+
 
 // Callback prototype for color setter
 typedef void (*setColorCallback_t)(uint8_t R, uint8_t G, uint8_t B);
@@ -66,11 +69,22 @@ public:
    void setPixelColor(int pixel, uint8_t r, uint8_t g, uint8_t b); // enable calling from sketch
    void setBrightness(int brightness);
    void clear();
+   void tick(Stream *stream);        // shows strips changed since the previous update
+   void show();                      // shows changed strips now
+   void setRefreshRate(int hz);      // 0 shows changes at the end of each request
+   void setImmediateShow(bool isImmediate); // true shows the strip each time a sketch sets a pixel
 private:   
+   void markChanged();
+   void update();                    // shows changed strips if the refresh interval has elapsed
    Adafruit_NeoPixel* stripPtr;
    int stripIndex;  // strip number of using multiple strips
    int nbrStrips;
    setColorCallback_t setColorCallback;
+   uint32_t changedStrips;           // bit for each strip with pixels not yet shown
+   bool isImmediateShow;
+   bool isInRequest;                 // changes made by requests are always deferred
+   unsigned int refreshInterval;     // ms, 0 if not limited
+   uint32_t prevShowMillis;
 
 };   
 
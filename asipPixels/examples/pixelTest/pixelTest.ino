@@ -32,6 +32,7 @@ void setup()
   beginAsipComms();
   // start the services   
   asipPixels.begin(neoPixelPin, &strip);
+  asipPixels.setImmediateShow(true); // colors set by this sketch are shown at once, requests are still shown once each
   asipIO.begin();  // NEW from  v1.1: core I/O service must follow all other service begin methods
 
   for (unsigned int i = 0; i < asipServiceCount(services); i++)
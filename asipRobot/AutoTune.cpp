@@ -0,0 +1,104 @@
+/* AutoTune.cpp
+ * Relay feedback auto-tune for a wheel speed loop.
+ * The ultimate gain is Ku = 4 * relayStep / (PI * amplitude) and the ultimate period Tu is
+ * the measured oscillation period. Ziegler-Nichols PI values are Kc = 0.45Ku and Ti = Tu / 1.2.
+ * MotorPID adds its output to the previous output each frame, so its Kd term acts on the change
+ * in speed as proportional gain and its Kp term acts as integral gain. Both are expressed per
+ * frame at the control rate with speed in ticks per frame, so Kd = Kc * Ko and Kp = Kc * Ko / (Ti * frameHz).
+ */
+
+#include "AutoTune.h"
+#include "MotorPid.h"  // for PID_FRAME_HZ
+
+RelayAutoTune::RelayAutoTune()
+{
+   state = AUTOTUNE_IDLE;
+}
+
+void RelayAutoTune::start(int32_t setpoint, int pwm, int frameHz, uint32_t nowMicros)
+{
+   this->frameHz = frameHz > 0 ? frameHz : PID_FRAME_HZ;
+   this->setpoint = abs(setpoint);
+   hysteresis = this->setpoint / 20;
+   bias = abs(pwm);
+   relayStep = bias / 2;
+   isHigh = true;
+   startMicros = prevSwitchMicros = nowMicros;
+   peakHigh = 0;
+   peakLow = this->setpoint;
+   cycles = -1;   // the first cycle starts from rest so it is not measured
+   periodSum = 0;
+   amplitudeSum = 0;
+   state = AUTOTUNE_RUNNING;
+}
+
+void RelayAutoTune::stop()
+{
+   state = AUTOTUNE_IDLE;
+}
+
+int RelayAutoTune::update(int32_t velocity, uint32_t nowMicros)
+{
+   if( state != AUTOTUNE_RUNNING) {
+      return 0;
+   }
+   if( nowMicros - startMicros > AUTOTUNE_TIMEOUT) {
+      state = AUTOTUNE_FAILED;  // speed never oscillated about the setpoint
+      return 0;
+   }
+   velocity = abs(velocity);
+   if( velocity > peakHigh) 
+      peakHigh = velocity;
+   if( velocity < peakLow) 
+      peakLow = velocity;
+   if( isHigh && velocity > setpoint + hysteresis) {
+      isHigh = false;
+   }
+   else if( !isHigh && velocity < setpoint - hysteresis) {
+      // a low to high switch completes a cycle
+      isHigh = true;
+      if( cycles >= 0) {
+         periodSum += nowMicros - prevSwitchMicros;
+         amplitudeSum += (peakHigh - peakLow) / 2;
+      }
+      cycles++;
+      prevSwitchMicros = nowMicros;
+      peakHigh = 0;
+      peakLow = setpoint;
+      if( cycles >= AUTOTUNE_CYCLES) {
+         calculateGains();
+         return 0;
+      }
+   }
+   return isHigh ? bias + relayStep : bias - relayStep;
+}
+
+void RelayAutoTune::calculateGains()
+{
+   result.period = periodSum / AUTOTUNE_CYCLES;
+   result.amplitude = amplitudeSum / AUTOTUNE_CYCLES;
+   if( result.amplitude <= 0 || result.period == 0) {
+      state = AUTOTUNE_FAILED;
+      return;
+   }
+   float amplitudePerFrame = (float)result.amplitude / frameHz; // ticks per frame
+   float Ku = 4 * relayStep / (PI * amplitudePerFrame);
+   float Tu = result.period / 1000000.0;
+   float Kc = 0.45 * Ku;
+   float Ti = Tu / 1.2;
+   result.Ko = AUTOTUNE_KO;
+   result.Kd = (int16_t)(Kc * AUTOTUNE_KO + 0.5);
+   result.Kp = (int16_t)(Kc * AUTOTUNE_KO / (Ti * frameHz) + 0.5);
+   result.Ki = 0;
+   state = AUTOTUNE_DONE;
+}
+
+autoTuneState_t RelayAutoTune::getState()
+{
+   return state;
+}
+
+const autoTuneResult_t &RelayAutoTune::getResult()
+{
+   return result;
+}
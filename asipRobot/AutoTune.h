@@ -0,0 +1,56 @@
+/* AutoTune.h
+ * Relay feedback auto-tune for a wheel speed loop.
+ * The motor PWM is switched between two levels each time the speed crosses
+ * the setpoint. The period and amplitude of the resulting speed oscillation 
+ * give the ultimate gain and period used to propose PID gains.
+ */
+
+#ifndef AutoTune_h
+#define AutoTune_h
+#include "Arduino.h"
+
+const int  AUTOTUNE_CYCLES   = 4;        // number of measured oscillations, the first cycle is discarded 
+const long AUTOTUNE_TIMEOUT  = 20000000; // microseconds, tuning fails if not complete in this time
+const int  AUTOTUNE_KO       = 100;      // Ko used for proposed gains
+
+enum autoTuneState_t {AUTOTUNE_IDLE, AUTOTUNE_RUNNING, AUTOTUNE_DONE, AUTOTUNE_FAILED};
+
+typedef struct {
+   int16_t Kp;
+   int16_t Ki;
+   int16_t Kd;
+   int16_t Ko;
+   uint32_t period;     // oscillation period in microseconds
+   int32_t amplitude;   // oscillation amplitude in ticks per second 
+} autoTuneResult_t;
+
+class RelayAutoTune
+{
+    public:
+        RelayAutoTune();
+        void start(int32_t setpoint, int pwm, int frameHz, uint32_t nowMicros); // setpoint in ticks per sec, relay switches pwm by +-50%
+        void stop();
+        int update(int32_t velocity, uint32_t nowMicros); // velocity in ticks per sec, returns the pwm to apply 
+        autoTuneState_t getState();
+        const autoTuneResult_t &getResult();
+
+    private:
+        void calculateGains();
+        autoTuneState_t state;
+        int32_t setpoint;
+        int32_t hysteresis;     // speed band around the setpoint to reject noise
+        int bias;               // mid pwm
+        int relayStep;          // pwm change each side of bias
+        int frameHz;            // PID frames per second the gains are calculated for
+        boolean isHigh;         // relay state
+        uint32_t startMicros;
+        uint32_t prevSwitchMicros; // time relay last switched to high
+        int32_t peakHigh;
+        int32_t peakLow;
+        int cycles;             // completed oscillations
+        uint32_t periodSum;
+        int32_t amplitudeSum;
+        autoTuneResult_t result;
+};
+
+#endif
@@ -4,6 +4,7 @@
  */
 
 #include "config.h" 
+#include "MotorPid.h"  // for PID_FRAME_HZ
 #include "utility/asip_debug.h" // this file is in the ASIP library folder
 
 
@@ -12,16 +13,46 @@ pidCfg_t configData;
 
 void setConfigDefaults( )
 {
-  configData.Kp = 20;
-  configData.Kd = 12;
-  configData.Ki = 0;
-  configData.Ko = 20;  
+  for(int i=0; i < CONFIG_NBR_WHEELS; i++) {
+    configData.wheel[i].Kp = 20;
+    configData.wheel[i].Kd = 12;
+    configData.wheel[i].Ki = 0;
+    configData.wheel[i].Ko = 20;  
+  }
+  configData.controlHz = PID_FRAME_HZ;
+  for(int i=0; i < CONFIG_NBR_IR_SENSORS; i++) {
+    configData.ir.min[i] = configData.ir.max[i] = 0; // uncalibrated
+  }
+}
+
+pidCfg_t *getPidConfig()
+{
+  return &configData;
+}
+
+void updateConfig(pidCfg_t *cfgPtr)
+{
+  if( cfgPtr != &configData) {
+    configData = *cfgPtr;
+  }
+}
+
+void showConfig()
+{
+  for(int i=0; i < CONFIG_NBR_WHEELS; i++) {
+    debug_printf("wheel %d: Kp= %d, Ki= %d, Kd= %d, Ko= %d\n", i, configData.wheel[i].Kp, configData.wheel[i].Ki, 
+                  configData.wheel[i].Kd, configData.wheel[i].Ko);
+  }
+  debug_printf("control rate %d Hz\n", configData.controlHz);
+  for(int i=0; i < CONFIG_NBR_IR_SENSORS; i++) {
+    debug_printf("IR %d: min= %d, max= %d\n", i, configData.ir.min[i], configData.ir.max[i]);
+  }
 }
 
 #if defined(TARGET_RP2040) || defined(TARGET_RASPBERRY_PI_PICO) || ARDUINO_SAMD_ZERO
 // here if board does not have eeprom
 
-void saveConfig(){} // do nothing
+bool saveConfig(){ return false;} // do nothing
 
 bool restoreConfig(){
     setConfigDefaults();
@@ -33,7 +64,7 @@ bool restoreConfig(){
 #include <EEPROM.h>
  
 // write header and save core data
-void saveConfig()
+bool saveConfig()
 {
 #ifdef  CONFIG_DEBUG 
   debug_printf("saving config\n");
@@ -55,6 +86,7 @@ void saveConfig()
    }
    debug_printf("\n");
 #endif    
+  return true;
 }
 
 
@@ -88,17 +120,15 @@ bool restoreConfig()
              cfgPtr[i] = EEPROM.read( bodyOffset + i );                    
           }                             
 #ifdef  CONFIG_DEBUG 
-         debug_printf("after reading eeprom");  
-         debug_printf(" Kp= %d", configData.Kp );
-         debug_printf(", Ki= %d", configData.Ki );
-         debug_printf(", Kd= %d", configData.Kd );
-         debug_printf(", Ko= %d", configData.Ko );             
+         debug_printf("after reading eeprom\n");  
+         showConfig();
 #endif 
       ret = true; 
       }
       else
       {  
         debug_printf("Config version mismatch!\n");  
+        setConfigDefaults();  
       }    
    } 
    else
@@ -8,7 +8,12 @@
 #include <stdint.h>
 
 const int16_t  CONFIG_ID      = 0x132; // unique number indicating that this is valid config
-const uint16_t CONFIG_VERSION = 0x1;   // version number incremented when config format changes 
+const uint16_t CONFIG_VERSION = 0x4;   // version number incremented when config format changes 
+                                       // version 2 has gains for each wheel and the control rate
+                                       // version 3 has gains for four wheels
+                                       // version 4 has IR sensor calibration
+const int CONFIG_NBR_WHEELS   = 4;     // number of wheels with stored gains, at least NBR_MOTORS
+const int CONFIG_NBR_IR_SENSORS = 5;   // number of IR line sensors with stored calibration
 
 typedef struct {
   int16_t  configId;            // a magic value to identify valid config data
@@ -20,7 +25,18 @@ typedef struct {
    int16_t Ki;
    int16_t Kd;
    int16_t Ko;      // scaling parameter
-   int8_t rfu[32];    // bytes reserved for future use    
+} pidGains_t;
+
+typedef struct {
+   uint16_t min[CONFIG_NBR_IR_SENSORS];  // ambient compensated readings over white and black 
+   uint16_t max[CONFIG_NBR_IR_SENSORS];  // a sensor is uncalibrated if max is not above min
+} irCalibration_t;
+
+typedef struct {
+   pidGains_t wheel[CONFIG_NBR_WHEELS];
+   uint16_t controlHz;  // PID frames per second, 0 services PID with encoder events
+   irCalibration_t ir;
+   int8_t rfu[12];    // bytes reserved for future use    
 } pidCfg_t;
 
 
@@ -35,7 +51,7 @@ extern pidCfg_t configData;
 
 //#define CONFIG_DEBUG
 
-void saveConfig();
+bool saveConfig();  // returns false if the board has no EEPROM
 bool restoreConfig();
 void setConfigDefaults( );
 pidCfg_t    *getPidConfig();
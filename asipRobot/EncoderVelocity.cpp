@@ -0,0 +1,60 @@
+/* EncoderVelocity.cpp
+ * Wheel speed estimate that is usable at low speeds.
+ * The speed is the number of ticks between the most recent edge of this frame and the 
+ * most recent edge of an earlier frame, divided by the time between those edges. 
+ * If edges are timed to the frame this is the counts per frame. Using edge times for every
+ * frame avoids the bias of switching to counts per frame at a threshold, a frame that
+ * happens to contain one tick more than the next would otherwise read fast. 
+ * Between edges the speed can be no more than one tick over the time since the last edge,
+ * so a stalled wheel decays towards zero.
+ */
+
+#include "EncoderVelocity.h"
+
+EncoderVelocity::EncoderVelocity()
+{
+   reset(0, 0);
+}
+
+void EncoderVelocity::reset(int32_t pos, uint32_t nowMicros)
+{
+   prevPos = edgePos = pos;
+   prevFrameMicros = edgeMicros = nowMicros;
+   velocity = 0;
+}
+
+int32_t EncoderVelocity::update(int32_t pos, uint32_t edgeTime, uint32_t nowMicros)
+{
+   int32_t delta = pos - prevPos;
+   uint32_t interval = nowMicros - prevFrameMicros;
+   
+   if( delta != 0) {
+      uint32_t span = edgeTime - edgeMicros;
+      if( span > 0) {
+         velocity = ((int64_t)(pos - edgePos) * VELOCITY_SCALE * 1000000L) / span;
+      }
+      else if( interval > 0) {
+         velocity = ((int64_t)delta * VELOCITY_SCALE * 1000000L) / interval;
+      }
+      edgePos = pos;
+      edgeMicros = edgeTime;
+   }
+   else {
+      uint32_t sinceEdge = nowMicros - edgeMicros;
+      if( sinceEdge > VELOCITY_TIMEOUT) {
+         velocity = 0;
+      }
+      else if( sinceEdge > 0) {
+         int32_t limit = (VELOCITY_SCALE * 1000000L) / sinceEdge;
+         velocity = constrain(velocity, -limit, limit);
+      }
+   }
+   prevPos = pos;
+   prevFrameMicros = nowMicros;
+   return velocity;
+}
+
+int32_t EncoderVelocity::getVelocity()
+{
+   return velocity;
+}
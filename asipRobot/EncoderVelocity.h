@@ -0,0 +1,31 @@
+/* EncoderVelocity.h
+ * Wheel speed estimate that is usable at low speeds.
+ * The speed is calculated from the ticks and the time between encoder edges, 
+ * so frames with only a few counts do not round the speed to whole ticks per frame.
+ */
+
+#ifndef EncoderVelocity_h
+#define EncoderVelocity_h
+#include "Arduino.h"
+
+const int  VELOCITY_SCALE            = 16;     // speeds are in ticks per second * VELOCITY_SCALE
+const long VELOCITY_TIMEOUT          = 500000; // speed is zero if no edges for this many microseconds
+
+class EncoderVelocity
+{
+    public:
+        EncoderVelocity();
+        void reset(int32_t pos, uint32_t nowMicros);
+        // pos is the encoder count, edgeMicros is the time pos last changed 
+        int32_t update(int32_t pos, uint32_t edgeMicros, uint32_t nowMicros); // returns the new speed
+        int32_t getVelocity(); // ticks per second * VELOCITY_SCALE
+
+    private:
+        int32_t prevPos;          // count at previous frame
+        uint32_t prevFrameMicros; // time of previous frame
+        int32_t edgePos;          // count at the most recent edge seen in a frame
+        uint32_t edgeMicros;      // time of that edge
+        int32_t velocity;
+};
+
+#endif
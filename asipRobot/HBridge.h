@@ -0,0 +1,144 @@
+/* HBridge.h
+ * H-Bridge driver policies selected at compile time.
+ * HBridge<Policy> remembers the last value written to each motor pin so the
+ * control loop can set direction and duty every frame without repeating
+ * digitalWrite or analogWrite calls when nothing has changed.
+ * The policy maps direction, brake mode and duty onto the pins of its driver IC.
+ */
+
+#ifndef HBridge_h
+#define HBridge_h
+#include "Arduino.h"
+
+typedef byte pinArray_t;
+
+enum motorPinIndex {in1Pin,in2Pin,PWMPin,EncApin,EncBpin};
+
+enum hBridgeType {_TB6612FNG, _DRV8833};
+
+const byte HBRIDGE_PIN_COUNT = 3;   // in1, in2 and pwm
+
+// last value written to each pin, -1 if unknown
+class HBridgePins
+{
+    public:
+        void setPins(pinArray_t *pins) { this->pins = pins; invalidate(); }
+        void invalidate() { for(byte i=0; i < HBRIDGE_PIN_COUNT; i++) value[i] = -1; }
+        void output(byte index) { pinMode(pins[index], OUTPUT); }
+        inline void digital(byte index, byte level) {
+            if( value[index] != level) {
+                digitalWrite(pins[index], level);
+                value[index] = level;
+            }
+        }
+        inline void analog(byte index, int duty) {
+            if( value[index] != duty) {
+                analogWrite(pins[index], duty);
+                value[index] = duty;
+            }
+        }
+    private:
+        pinArray_t *pins;
+        int16_t value[HBRIDGE_PIN_COUNT];
+};
+
+// Toshiba TB6612FNG: direction on in1 and in2, duty on the PWM pin
+class TB6612Policy
+{
+    public:
+        void setType(int type) {}  // fixed at compile time
+        void begin(HBridgePins &pins) {
+            pins.output(in1Pin);
+            pins.output(in2Pin);
+        }
+        // returns the index of the pin that carries the duty
+        byte setDirection(HBridgePins &pins, boolean reverse, boolean brake) {
+            pins.digital(in1Pin, reverse ? 1 : 0);
+            pins.digital(in2Pin, reverse ? 0 : 1);
+            return PWMPin;
+        }
+        void setDuty(HBridgePins &pins, byte pwmIndex, int duty, boolean brake) {
+            pins.analog(pwmIndex, duty);
+        }
+};
+
+// TI DRV8833: PWM on one input with the other held at a level set by the brake mode
+class DRV8833Policy
+{
+    public:
+        void setType(int type) {}  // fixed at compile time
+        void begin(HBridgePins &pins) {}  // uses analogWrite so no need for pinMode
+        byte setDirection(HBridgePins &pins, boolean reverse, boolean brake) {
+            int modeVal = brake ? 0 : 255; // value written to non pwm pin dependent on brake mode
+            if( reverse ^ brake) {
+                pins.analog(in2Pin, modeVal);
+                return in1Pin;
+            }
+            pins.analog(in1Pin, modeVal);
+            return in2Pin;
+        }
+        void setDuty(HBridgePins &pins, byte pwmIndex, int duty, boolean brake) {
+            pins.analog(pwmIndex, brake ? duty : 255 - duty); // coast mode inverts the PWM
+        }
+};
+
+// for boards where the H-bridge is detected at runtime, the type is set with setType
+class SelectableHBridgePolicy
+{
+    public:
+        SelectableHBridgePolicy() { type = _TB6612FNG; }
+        void setType(int type) { this->type = type; }
+        void begin(HBridgePins &pins) {
+            if( type == _DRV8833) drv8833.begin(pins); else tb6612.begin(pins);
+        }
+        byte setDirection(HBridgePins &pins, boolean reverse, boolean brake) {
+            if( type == _DRV8833) return drv8833.setDirection(pins, reverse, brake);
+            return tb6612.setDirection(pins, reverse, brake);
+        }
+        void setDuty(HBridgePins &pins, byte pwmIndex, int duty, boolean brake) {
+            if( type == _DRV8833) drv8833.setDuty(pins, pwmIndex, duty, brake);
+            else tb6612.setDuty(pins, pwmIndex, duty, brake);
+        }
+    private:
+        int type;
+        TB6612Policy tb6612;
+        DRV8833Policy drv8833;
+};
+
+template <class Policy>
+class HBridge : private HBridgePins
+{
+    public:
+        HBridge() { pwmIndex = PWMPin; }
+        void begin(pinArray_t *pins) {
+            setPins(pins);
+            policy.begin(*this);
+        }
+        void setType(int type) {
+            policy.setType(type);
+            policy.begin(*this);
+            invalidate();
+        }
+        // reverse is the direction the motor turns, after any inversion for the side of the robot
+        void setDirection(boolean reverse, boolean brake) {
+            pwmIndex = policy.setDirection(*this, reverse, brake);
+        }
+        void setDuty(int duty, boolean brake) {
+            policy.setDuty(*this, pwmIndex, duty, brake);
+        }
+    private:
+        Policy policy;
+        byte pwmIndex;   // the pin carrying the duty for the current direction
+};
+
+// the policy used by RobotMotor, define HBRIDGE_POLICY before this to override
+#ifndef HBRIDGE_POLICY
+#if defined (UNO_WIFI_REV2_328MODE) || defined (TARGET_RP2040) || defined(TARGET_RASPBERRY_PI_PICO) || defined(ARDUINO_ARCH_ESP32) || defined(DRV8833_HBRIDGE)
+#define HBRIDGE_POLICY DRV8833Policy
+#else
+// NOTE teensy can use non DRV8833 so H-Bridge type must be set explicitly
+#define HBRIDGE_POLICY SelectableHBridgePolicy
+#endif
+#endif
+
+#endif
@@ -0,0 +1,63 @@
+/* Kinematics.cpp
+ * Forward and inverse kinematics for differential, skid-steer and mecanum drives.
+ */
+
+#include "Kinematics.h"
+
+DifferentialKinematics::DifferentialKinematics(float wheelTrack)
+{
+   this->wheelTrack = wheelTrack;
+}
+
+void DifferentialKinematics::toWheels(float vx, float vy, float omega, float wheel[])
+{
+   wheel[0] = vx - omega * wheelTrack / 2;
+   wheel[1] = vx + omega * wheelTrack / 2;
+}
+
+void DifferentialKinematics::toBody(const float wheel[], float &dx, float &dy, float &rotation)
+{
+   dx = (wheel[0] + wheel[1]) / 2;
+   dy = 0;
+   rotation = (wheel[1] - wheel[0]) / wheelTrack;
+}
+
+SkidSteerKinematics::SkidSteerKinematics(float effectiveTrack)
+{
+   this->effectiveTrack = effectiveTrack;
+}
+
+void SkidSteerKinematics::toWheels(float vx, float vy, float omega, float wheel[])
+{
+   wheel[0] = wheel[2] = vx - omega * effectiveTrack / 2;
+   wheel[1] = wheel[3] = vx + omega * effectiveTrack / 2;
+}
+
+void SkidSteerKinematics::toBody(const float wheel[], float &dx, float &dy, float &rotation)
+{
+   float left = (wheel[0] + wheel[2]) / 2;
+   float right = (wheel[1] + wheel[3]) / 2;
+   dx = (left + right) / 2;
+   dy = 0;
+   rotation = (right - left) / effectiveTrack;
+}
+
+MecanumKinematics::MecanumKinematics(float wheelTrack, float wheelBase)
+{
+   k = (wheelTrack + wheelBase) / 2;
+}
+
+void MecanumKinematics::toWheels(float vx, float vy, float omega, float wheel[])
+{
+   wheel[0] = vx - vy - omega * k;
+   wheel[1] = vx + vy + omega * k;
+   wheel[2] = vx + vy - omega * k;
+   wheel[3] = vx - vy + omega * k;
+}
+
+void MecanumKinematics::toBody(const float wheel[], float &dx, float &dy, float &rotation)
+{
+   dx = (wheel[0] + wheel[1] + wheel[2] + wheel[3]) / 4;
+   dy = (-wheel[0] + wheel[1] + wheel[2] - wheel[3]) / 4;
+   rotation = (-wheel[0] + wheel[1] - wheel[2] + wheel[3]) / (4 * k);
+}
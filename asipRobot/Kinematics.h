@@ -0,0 +1,59 @@
+/* Kinematics.h
+ * Maps between body motion and wheel motion for the supported drive layouts.
+ * Wheels are numbered left/right in pairs from the front: 0 front left, 1 front right,
+ * 2 rear left, 3 rear right. A differential drive uses wheels 0 and 1 only.
+ * Body x is forward, y is to the left and rotation is counter clockwise.
+ */
+
+#ifndef Kinematics_h
+#define Kinematics_h
+#include "Arduino.h"
+
+class Kinematics
+{
+    public:
+        // wheel surface speeds in mm per second for a body velocity in mm per second and radians per second
+        // (the same mapping converts a body displacement into wheel travel)
+        virtual void toWheels(float vx, float vy, float omega, float wheel[]) = 0;
+        // body displacement from the travel of each wheel in mm
+        virtual void toBody(const float wheel[], float &dx, float &dy, float &rotation) = 0;
+        virtual byte getWheelCount() = 0;
+};
+
+class DifferentialKinematics : public Kinematics
+{
+    public:
+        DifferentialKinematics(float wheelTrack); // mm between the wheel contact points
+        void toWheels(float vx, float vy, float omega, float wheel[]);  // vy is ignored
+        void toBody(const float wheel[], float &dx, float &dy, float &rotation);
+        byte getWheelCount() { return 2; }
+    private:
+        float wheelTrack;
+};
+
+// four wheels driven as two sides, the effective track is usually wider than 
+// the measured track because the wheels slip sideways when turning
+class SkidSteerKinematics : public Kinematics
+{
+    public:
+        SkidSteerKinematics(float effectiveTrack);
+        void toWheels(float vx, float vy, float omega, float wheel[]);  // vy is ignored
+        void toBody(const float wheel[], float &dx, float &dy, float &rotation);
+        byte getWheelCount() { return 4; }
+    private:
+        float effectiveTrack;
+};
+
+// four mecanum wheels with rollers at 45 degrees, forming an X when viewed from above 
+class MecanumKinematics : public Kinematics
+{
+    public:
+        MecanumKinematics(float wheelTrack, float wheelBase); // left to right and front to rear distances in mm
+        void toWheels(float vx, float vy, float omega, float wheel[]);
+        void toBody(const float wheel[], float &dx, float &dy, float &rotation);
+        byte getWheelCount() { return 4; }
+    private:
+        float k;  // half the sum of track and base
+};
+
+#endif
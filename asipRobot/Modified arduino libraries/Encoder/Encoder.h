@@ -2,6 +2,7 @@
  * http://www.pjrc.com/teensy/td_libs_Encoder.html
  * Copyright (c) 2011,2013 PJRC.COM, LLC - Paul Stoffregen <paul@pjrc.com>
  *
+ * ASIP modification - C-only code records the micros time of the most recent count 
  * Version 1.2 - fix -2 bug in C-only code
  * Version 1.1 - expand to support boards with up to 60 interrupts
  * Version 1.0 - initial release
@@ -58,6 +59,11 @@
 #define ENCODER_ISR_ATTR
 #endif
 
+// the AVR assembly update does not record edge times 
+#if !defined(__AVR__)
+#define ENCODER_EDGE_TIMES
+#endif
+
 
 
 // All the data needed by interrupts is consolidated into this ugly struct
@@ -71,6 +77,9 @@ typedef struct {
 	IO_REG_TYPE            pin2_bitmask;
 	uint8_t                state;
 	int32_t                position;
+#ifdef ENCODER_EDGE_TIMES
+	uint32_t               edgeMicros;  // time of the most recent count change
+#endif
 } Encoder_internal_state_t;
 
 class Encoder
@@ -91,6 +100,9 @@ public:
 		encoder.pin2_register = PIN_TO_BASEREG(pin2);
 		encoder.pin2_bitmask = PIN_TO_BITMASK(pin2);
 		encoder.position = 0;
+#ifdef ENCODER_EDGE_TIMES
+		encoder.edgeMicros = 0;
+#endif
 		// allow time for a passive R-C filter to charge
 		// through the pullup resistors, before reading
 		// the initial state
@@ -130,6 +142,21 @@ public:
 		interrupts();
 		return ret;
 	}
+#ifdef ENCODER_EDGE_TIMES
+	// returns position and sets edgeMicros to the time the position last changed
+	inline int32_t read(uint32_t &edgeMicros) {
+		if (interrupts_in_use < 2) {
+			noInterrupts();
+			update(&encoder);
+		} else {
+			noInterrupts();
+		}
+		int32_t ret = encoder.position;
+		edgeMicros = encoder.edgeMicros;
+		interrupts();
+		return ret;
+	}
+#endif
 	inline int32_t readAndReset() {
 		if (interrupts_in_use < 2) {
 			noInterrupts();
@@ -152,6 +179,13 @@ public:
 		update(&encoder);
 		return encoder.position;
 	}
+#ifdef ENCODER_EDGE_TIMES
+	inline int32_t read(uint32_t &edgeMicros) {
+		update(&encoder);
+		edgeMicros = encoder.edgeMicros;
+		return encoder.position;
+	}
+#endif
 	inline int32_t readAndReset() {
 		update(&encoder);
 		int32_t ret = encoder.position;
@@ -323,17 +357,22 @@ public:
 		switch (state) {
 			case 1: case 7: case 8: case 14:
 				arg->position++;
-				return;
+				break;
 			case 2: case 4: case 11: case 13:
 				arg->position--;
-				return;
+				break;
 			case 3: case 12:
 				arg->position += 2;
-				return;
+				break;
 			case 6: case 9:
 				arg->position -= 2;
-				return;
+				break;
+			default:
+				return;  // no movement
 		}
+#ifdef ENCODER_EDGE_TIMES
+		arg->edgeMicros = micros();
+#endif
 #endif
 	}
 private:
@@ -0,0 +1,118 @@
+/* MotionProfile.cpp
+ * Acceleration and jerk limited speed profile for a wheel.
+ * Each frame the speed moves towards the target with acceleration no more than accelLimit. 
+ * The acceleration itself changes by no more than jerkLimit and starts reducing early 
+ * enough that the speed does not overshoot. When a distance is given, the target is 
+ * capped to the speed that can still stop in the remaining distance.
+ */
+
+#include "MotionProfile.h"
+
+MotionProfile::MotionProfile()
+{
+   accelLimit = jerkLimit = 0;
+   distance = travelled = 0;
+   targetVelocity = 0;
+   finished = false;
+   stop();
+}
+
+void MotionProfile::setLimits(float accel, float jerk)
+{
+   accelLimit = fabs(accel);
+   jerkLimit = fabs(jerk);
+}
+
+boolean MotionProfile::isEnabled()
+{
+   return accelLimit > 0;
+}
+
+void MotionProfile::start(float targetVelocity, int32_t distance)
+{
+   // a move started while moving continues from the current profile speed
+   if( !active) {
+      velocity = acceleration = 0;
+   }
+   this->targetVelocity = targetVelocity;
+   this->distance = distance;
+   travelled = 0;
+   active = true;
+   finished = false;
+}
+
+void MotionProfile::stop()
+{
+   velocity = acceleration = 0;
+   active = false;
+}
+
+float MotionProfile::update(uint32_t intervalMicros, int32_t deltaTicks)
+{
+   if( !active) {
+      return 0;
+   }
+   float dt = intervalMicros / 1000000.0;
+   float goal = targetVelocity;
+   travelled += deltaTicks;
+   if( distance != 0) {
+      float remaining = distance > 0 ? distance - travelled : travelled - distance; 
+      if( remaining <= 0) {
+         stop();
+         finished = true;
+         return 0;
+      }
+      if( jerkLimit > 0) {
+         remaining -= fabs(velocity) * accelLimit / jerkLimit; // distance covered while deceleration builds up
+      }
+      float stopVelocity = remaining > 0 ? sqrt(2 * accelLimit * remaining) : 0;
+      if( stopVelocity < PROFILE_CRAWL_SPEED) {
+         stopVelocity = PROFILE_CRAWL_SPEED;
+      }
+      if( fabs(goal) > stopVelocity) {
+         goal = goal > 0 ? stopVelocity : -stopVelocity;
+      }
+   }
+
+   float dv = goal - velocity;
+   float accelTarget; 
+   if( jerkLimit > 0) {
+      // velocity change while the present acceleration is ramped down to zero
+      float rampDownDv = acceleration * fabs(acceleration) / (2 * jerkLimit);
+      if( dv > rampDownDv)
+         accelTarget = accelLimit;
+      else if( dv < rampDownDv)
+         accelTarget = -accelLimit;
+      else
+         accelTarget = 0;
+      float maxStep = jerkLimit * dt;
+      acceleration += constrain(accelTarget - acceleration, -maxStep, maxStep);
+   }
+   else {
+      acceleration = dv > 0 ? accelLimit : (dv < 0 ? -accelLimit : 0);
+   }
+   float step = acceleration * dt;
+   if( (dv >= 0 && step >= dv) || (dv <= 0 && step <= dv)) {
+      velocity = goal;  // goal reached in this frame
+      acceleration = 0;
+   }
+   else {
+      velocity += step;
+   }
+   return velocity;
+}
+
+boolean MotionProfile::isActive()
+{
+   return active;
+}
+
+boolean MotionProfile::isFinished()
+{
+   return finished;
+}
+
+float MotionProfile::getVelocity()
+{
+   return velocity;
+}
@@ -0,0 +1,39 @@
+/* MotionProfile.h
+ * Acceleration and jerk limited speed profile for a wheel.
+ * The profile ramps the speed given to the PID instead of stepping it to the 
+ * requested value. A move can be given a distance, the speed is then reduced 
+ * as the distance is approached so the wheel stops at the requested count.
+ */
+
+#ifndef MotionProfile_h
+#define MotionProfile_h
+#include "Arduino.h"
+
+const float PROFILE_CRAWL_SPEED = 50;  // ticks per second, minimum speed while approaching the end of a move
+
+class MotionProfile
+{
+    public:
+        MotionProfile();
+        void setLimits(float accel, float jerk); // ticks/sec/sec and ticks/sec/sec/sec, accel of 0 disables profiles, jerk of 0 is unlimited
+        boolean isEnabled();
+        void start(float targetVelocity, int32_t distance); // ticks per sec, distance in ticks (0 runs until stopped) 
+        void stop();
+        float update(uint32_t intervalMicros, int32_t deltaTicks); // returns the speed for this frame  
+        boolean isActive();
+        boolean isFinished();   // true when the distance has been reached
+        float getVelocity();
+
+    private:
+        float accelLimit;
+        float jerkLimit;
+        float targetVelocity;   // cruise speed 
+        float velocity;         // profile speed 
+        float acceleration;     // profile acceleration  
+        int32_t distance;       // ticks to move, 0 if no distance limit
+        int32_t travelled;      // ticks moved since start
+        boolean active;
+        boolean finished;
+};
+
+#endif
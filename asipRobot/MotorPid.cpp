@@ -12,59 +12,93 @@ MotorPID::MotorPID(int encoderPPR, int maxPwm, int maxPwmDelta)
    this->encoderPPR = encoderPPR; 
    this->maxPwm = maxPwm;
    this->maxPwmDelta = maxPwmDelta;     
+#ifdef EXTERNAL_PID_SCHEDULAR
+   externalScheduling = true;
+#else
+   externalScheduling = false;
+#endif
+   memset(&telemetry, 0, sizeof(telemetry));
 }
  
 void  MotorPID::initPid(int Kp, int Ki, int Kd, int Ko )
 {
-  targetTicksPerSecond = 0;  
+  targetTicksPerSecond = targetTrim = 0;  
   prevOutput = prevInput = iTerm = 0;
+  targetRemainder = 0;
  
   // set values from eeprom
   this->Kp = Kp; // 20;   5
   this->Kd = Kd; // 12;
   this->Ki = Ki; // 0;
   this->Ko = Ko;  // 20;
-  frameInterval = 1000/PID_FRAME_HZ;
+  frameInterval = 1000000L/PID_FRAME_HZ;
   debug_printf("PID vals: %d, %d, %d, %d\n", this->Kp, this->Kd, this->Ki, this->Ko );  
   debug_printf("Motor encoderPPR=%d, maxPwm = %d, maxPwmDelta=%d\n",  encoderPPR, maxPwm, maxPwmDelta );
 }
 
-void MotorPID::updatePid( int Kp, int Ki, int Kd, int Ko, unsigned long interval)
+void MotorPID::updatePid( int Kp, int Ki, int Kd, int Ko, unsigned long intervalMicros)
 {
   this->Kp = Kp;
   this->Ki = Ki;   
   this->Kd = Kd;
   this->Ko = Ko;
-  this->frameInterval =  interval;
+  this->frameInterval =  intervalMicros;
   debug_printf("PID vals: %d, %d, %d, %d\n", this->Kp, this->Kd, this->Ki, this->Ko ); 
 }
 
-void MotorPID::getPid( int &KpOut, int &KiOut, int &KdOut, int &KoOut, unsigned long &interval)
+void MotorPID::getPid( int &KpOut, int &KiOut, int &KdOut, int &KoOut, unsigned long &intervalMicros)
 {
   KpOut = this->Kp;
   KiOut = this->Ki;   
   KdOut = this->Kd;
   KoOut = this->Ko;
-  interval = frameInterval;
+  intervalMicros = frameInterval;
+}
+
+void MotorPID::setFrameInterval(unsigned long intervalMicros)
+{
+  frameInterval = intervalMicros;
+}
+
+const pidTelemetry_t &MotorPID::getTelemetry()
+{
+  return telemetry;
+}
+
+void MotorPID::setExternalScheduling(boolean isExternal)
+{
+  externalScheduling = isExternal;
 }
 
 void MotorPID::startPid( long targetTicks, long dur)
 {   
   isActive = true;
-  startTime = prevPulseMillis = prevPidService = millis();
+  startTime = prevPulseMillis = millis();
+  prevPidService = micros();
   duration = dur;  
   prevOutput = prevInput = 0;
+  targetRemainder = 0;
   targetTicksPerSecond = targetTicks;
+  targetTrim = 0;
   debug_printf("%s pid started, ticks=%d, dur=%d\n",label, targetTicksPerSecond, dur);
 }
 
+void MotorPID::setTarget(long targetTicks)
+{   
+  targetTicksPerSecond = targetTicks;
+}
+
+void MotorPID::setTargetTrim(long ticksPerSecond)
+{   
+  targetTrim = ticksPerSecond;
+}
+
 boolean MotorPID::isPidServiceNeeded()
 {
-#ifndef  EXTERNAL_PID_SCHEDULAR
-  return( isPidActive()  && (millis() - prevPidService >= frameInterval))  ;
-#else 
-  return isPidActive();
-#endif
+  if( externalScheduling) {
+    return isPidActive();
+  }
+  return( isPidActive()  && (micros() - prevPidService >= frameInterval))  ;
 }
 
 
@@ -76,16 +110,18 @@ boolean MotorPID::isPidActive()
 void  MotorPID::stopPid()
 {
   this->isActive = false;
+  telemetry.flags = 0;  // telemetry reports the wheel as inactive
 }
 
 // return true unless PID is inactive or has timed out.
-boolean  MotorPID::servicePid(long encoderCount, motorPwmFunc setMotorPwm)
+boolean  MotorPID::servicePid(long velocity, motorPwmFunc setMotorPwm)
 {
 long pError;
 long pid;
 long input;
 int output;
 unsigned long timeDelta;
+int maxDelta;
   
   if(!isActive) {         
     return false;
@@ -93,47 +129,61 @@ unsigned long timeDelta;
   unsigned long timeNow = millis();
   if( timeNow - startTime > duration) {       
         debug_printf("%s stopped- duration achieved\n", label); 
-        isActive = false;        
+        stopPid();        
         return false;  
   } 
   if( isPidServiceNeeded() ) {     
-     timeDelta = timeNow - prevPidService;
-     prevPidService = timeNow;  
-    input = encoderCount; 
+     unsigned long microsNow = micros();
+     timeDelta = microsNow - prevPidService; // microseconds
+     prevPidService = microsNow;  
+    // input and target are ticks in this frame * VELOCITY_SCALE so low speeds are not rounded to whole ticks
+    // timeDelta is used in 100us units to avoid overflow, the target fraction is carried so short frames don't lose ticks
+    input = (velocity * (long)(timeDelta / 100)) / 10000; 
     if( input != 0) {
        prevPulseMillis = timeNow;
     }
     else if( timeNow - prevPulseMillis > AUTO_STOP_INTERVAL) {       
         debug_printf("\nauto stop because no encoder pulse after %d ms\n",AUTO_STOP_INTERVAL );
-        isActive = false;
+        stopPid();
         return false;               
     }  
-    long targetTicks = map(timeDelta, 0, 1000, 0, targetTicksPerSecond);
+    long scaledTicks = (targetTicksPerSecond + targetTrim) * VELOCITY_SCALE * (long)(timeDelta / 100) + targetRemainder;
+    long targetTicks = scaledTicks / 10000; 
+    targetRemainder = scaledTicks % 10000;
     pError = targetTicks - input;
-    pid = (Kp * pError - Kd * (input - prevInput) + iTerm) / Ko;    
+    pid = (Kp * pError - Kd * (input - prevInput) + iTerm) / (Ko * VELOCITY_SCALE);    
+    telemetry.flags = PID_FLAG_ACTIVE;
+    telemetry.pid = constrain(pid, -32767L, 32767L);
     
-    // acceleration limit
-    if( pid > maxPwmDelta)
-       pid = maxPwmDelta;
-    else if (pid < -maxPwmDelta)
-       pid = -maxPwmDelta;
+    // acceleration limit, maxPwmDelta is the limit for a frame at the current frame interval 
+    maxDelta = max(1L, (long)((maxPwmDelta * (long)(timeDelta / 100)) / (long)(frameInterval / 100)));
+    if( pid > maxDelta || pid < -maxDelta) {
+       pid = pid > 0 ? maxDelta : -maxDelta;
+       telemetry.flags |= PID_FLAG_ACCEL_LIMITED;
+    }
        
     output = pid + prevOutput;
    
     // Accumulate Integral error *or* Limit output.
     // Stop accumulating when output saturates
-    if (output >= maxPwm)
-      output = maxPwm;
-    else if (output <= -maxPwm)
-      output = -maxPwm;
+    if (output >= maxPwm || output <= -maxPwm) {
+      output = output > 0 ? maxPwm : -maxPwm;
+      telemetry.flags |= PID_FLAG_SATURATED;
+    }
     else
       iTerm += Ki * pError;
 
+    telemetry.target = constrain(targetTicks, -32767L, 32767L);
+    telemetry.input = constrain(input, -32767L, 32767L);
+    telemetry.error = constrain(pError, -32767L, 32767L);
+    telemetry.iTerm = constrain(iTerm, -32767L, 32767L);
+    telemetry.output = output;
+
     prevOutput = output;
     prevInput = input;
     
     setMotorPwm(output);    
-    debug_printf("%s svc after %dms, in=%d, err=%d, pid=%d, out=%d\n", label, timeDelta, input, pError, pid, output);
+    debug_printf("%s svc after %dus, in=%d, err=%d, pid=%d, out=%d\n", label, timeDelta, input, pError, pid, output);
   } 
   else {
     debug_printf("!ERROR - PID service called too soon, check isPidServiceNeeded() method before calling\n");
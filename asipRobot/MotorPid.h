@@ -7,18 +7,36 @@
 #ifndef MotorPid_h
 #define MotorPid_h
 #include "Arduino.h"
+#include "EncoderVelocity.h" // for VELOCITY_SCALE
 //#include <functional> // for Lambda
 
-const int PID_FRAME_HZ        = 30;                       //  frames per second  
+const int PID_FRAME_HZ        = 30;                       //  default frames per second  
+const int MAX_PID_FRAME_HZ    = 1000;
 const int AUTO_STOP_INTERVAL  = 2000; // turn off PWM if no encoder pulses after this many ms
 
 /*
  * PID code manage from intervals or relagate this to an extrnal schedular
  * uncomment EXTERNAL_PID_SCHEDULAR if used with ASIP or other scheduling code
+ * this sets the default, setExternalScheduling can change this at runtime
  */
 #define EXTERNAL_PID_SCHEDULAR // define this if frame intervals are controlled by ASIP motor code
 
 typedef void (*motorPwmFunc)(int); // callback to control motor PWM
+
+// values calculated in the most recent PID frame, ticks are per frame * VELOCITY_SCALE
+const byte PID_FLAG_ACTIVE        = 0x01;
+const byte PID_FLAG_SATURATED     = 0x02;  // output at maxPwm
+const byte PID_FLAG_ACCEL_LIMITED = 0x04;  // change in output clipped to maxPwmDelta
+
+typedef struct {
+   int16_t target;
+   int16_t input;
+   int16_t error;
+   int16_t iTerm;    // clipped to int16 range
+   int16_t pid;      // change in output before acceleration limit
+   int16_t output;   // pwm
+   uint8_t flags;
+} pidTelemetry_t;
  
 class MotorPID
 {
@@ -26,12 +44,17 @@ class MotorPID
         MotorPID(int encoderPPR, int maxPwm, int maxPwmDelta );
         void initPid(int Kp, int Ki, int Kd, int Ko ); 
         void startPid( long targetTicksPerSecond, long duration);
-        boolean servicePid(long count, motorPwmFunc setMotorPwm);
+        boolean servicePid(long velocity, motorPwmFunc setMotorPwm); // velocity is ticks per second * VELOCITY_SCALE
+        void setTarget(long targetTicksPerSecond);  // changes the speed of a running PID
+        void setTargetTrim(long ticksPerSecond);    // correction added to the target, used to synchronize wheels
         void stopPid();
-        void updatePid( int Kp, int Ki, int Kd, int Ko, unsigned long interval);
-        void getPid( int &Kp, int &Ki, int &Kd, int &Ko,unsigned long &interval);
+        void updatePid( int Kp, int Ki, int Kd, int Ko, unsigned long intervalMicros);
+        void getPid( int &Kp, int &Ki, int &Kd, int &Ko,unsigned long &intervalMicros);
         boolean isPidServiceNeeded();
         boolean isPidActive();
+        const pidTelemetry_t &getTelemetry();
+        void setExternalScheduling(boolean isExternal); // true if caller controls frame intervals
+        void setFrameInterval(unsigned long intervalMicros);
          
         const char * label; // motor label, for debug only  
 
@@ -41,12 +64,14 @@ class MotorPID
         int maxPwm;                              // max PWM motor value
         int maxPwmDelta;                         // max change in PWM between consecutive frames    
         long targetTicksPerSecond;               // target speed in ticks per second
+        long targetTrim;                         // ticks per second added to the target 
         long encoder;                            // encoder count               
-        int prevInput;                           // last input 
-        int iTerm;                               // integrated term
+        long prevInput;                          // last input, ticks per frame * VELOCITY_SCALE 
+        long iTerm;                              // integrated term
+        long targetRemainder;                    // fraction of a target tick carried to the next frame
         int prevOutput;                          // last motor setting 
 
-        unsigned long prevPidService;            // time of last PID calculation 
+        unsigned long prevPidService;            // micros time of last PID calculation 
         unsigned long prevPulseMillis;           // time of frame containing most recent encoder pulse (for auto shotoff)
         unsigned long startTime;                 // millis time of setMotorRPM call (for duration timeout)
         unsigned long duration;                  // number of milliseconds to run (-1 runs for 49+ days)
@@ -55,7 +80,9 @@ class MotorPID
         int16_t Ki;
         int16_t Kd;
         int16_t Ko;                              // scaling divisor enables use of integer PID constants
-        unsigned long frameInterval;             // 1000 / PID_FRAME_HZ (milliseconds for each frame) 
+        unsigned long frameInterval;             // 1000000 / PID_FRAME_HZ (microseconds for each frame) 
+        boolean externalScheduling;
+        pidTelemetry_t telemetry;
         
 };
 
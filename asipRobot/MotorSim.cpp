@@ -0,0 +1,144 @@
+/* MotorSim.cpp
+ * Simulation of a geared DC motor driving a wheel with a quadrature encoder.
+ * Armature inductance is ignored, so current is (V - Ke * omega) / R and the motor 
+ * torque, less viscous and coulomb friction, accelerates the inertia at the motor shaft.
+ * The wheel angle is the integral of motor speed divided by the gear ratio and the 
+ * encoder count is the whole number of ticks in that angle.
+ */
+
+#include "MotorSim.h"
+#include "RobotDescription.h"
+
+// a small geared motor with the gear ratio and encoder of the robot in RobotDescription.h
+const motorSimParams_t defaultMotorSimParams = {
+   6.0,      // supplyVoltage  
+   5.0,      // resistance
+   0.008,    // torqueConstant
+   1.0e-6,   // inertia
+   2.0e-7,   // viscousFriction
+   8.0e-4,   // coulombFriction
+#ifdef HUBEE_WHEELS
+   120,      // gearRatio
+#else
+   GEAR_REDUCTION, 
+#endif
+   ENCODER_TICKS_PER_WHEEL_REV,
+   255       // maxPwm
+};
+
+MotorSim::MotorSim(const motorSimParams_t &params) : params(params)
+{
+   reset();
+}
+
+void MotorSim::reset()
+{
+   pwm = 0;
+   omega = 0;
+   wheelAngle = 0;
+   positionOffset = position = 0;
+   simMicros = edgeMicros = 0;
+}
+
+void MotorSim::setPwm(int pwm)
+{
+   this->pwm = constrain(pwm, -params.maxPwm, params.maxPwm);
+}
+
+void MotorSim::step(uint32_t intervalMicros)
+{
+   while( intervalMicros > 0) {
+      uint32_t stepMicros = min(intervalMicros, MOTOR_SIM_STEP);
+      intervalMicros -= stepMicros;
+      simMicros += stepMicros;
+      float dt = stepMicros / 1000000.0;
+      
+      float volts = params.supplyVoltage * pwm / params.maxPwm;
+      float current = (volts - params.torqueConstant * omega) / params.resistance;
+      float torque = params.torqueConstant * current - params.viscousFriction * omega;
+      if( omega == 0 && fabs(torque) <= params.coulombFriction) {
+         continue; // static friction holds the motor
+      }
+      float friction = omega > 0 || (omega == 0 && torque > 0) ? params.coulombFriction : -params.coulombFriction;
+      float newOmega = omega + (torque - friction) / params.inertia * dt;
+      if( (omega > 0 && newOmega < 0) || (omega < 0 && newOmega > 0)) {
+         newOmega = 0;  // friction stops the motor, it does not reverse it
+      }
+      omega = newOmega;
+      wheelAngle += omega / params.gearRatio * dt;
+      int32_t newPosition = positionOffset + (int32_t)floor(wheelAngle / (2 * PI) * params.ticksPerRev);
+      if( newPosition != position) {
+         position = newPosition;
+         edgeMicros = simMicros;
+      }
+   }
+}
+
+int32_t MotorSim::getPosition()
+{
+   return position;
+}
+
+void MotorSim::setPosition(int32_t position)
+{
+   wheelAngle = 0;
+   positionOffset = this->position = position;
+}
+
+uint32_t MotorSim::getEdgeMicros()
+{
+   return edgeMicros;
+}
+
+uint32_t MotorSim::getMicros()
+{
+   return simMicros;
+}
+
+uint8_t MotorSim::getQuadratureState()
+{
+   static const uint8_t grayCode[4] = {0, 1, 3, 2};  // A leads B for positive counts 
+   return grayCode[position & 3];
+}
+
+float MotorSim::getWheelSpeed()
+{
+   return omega / params.gearRatio;
+}
+
+SimEncoder::SimEncoder(MotorSim *motor)
+{
+   this->motor = motor;
+   startMicros = 0;
+}
+
+void SimEncoder::begin()
+{
+   motor->reset();
+   startMicros = micros();
+}
+
+void SimEncoder::update()
+{
+   uint32_t elapsed = micros() - startMicros;
+   motor->step(elapsed - motor->getMicros());
+}
+
+int32_t SimEncoder::read()
+{
+   update();
+   return motor->getPosition();
+}
+
+int32_t SimEncoder::read(uint32_t &edgeMicros)
+{
+   update();
+   edgeMicros = startMicros + motor->getEdgeMicros();
+   return motor->getPosition();
+}
+
+void SimEncoder::write(int32_t position)
+{
+   update();
+   motor->setPosition(position);
+}
@@ -0,0 +1,72 @@
+/* MotorSim.h
+ * Simulation of a geared DC motor driving a wheel with a quadrature encoder.
+ * Used in place of the motors and encoders when MOTOR_SIMULATION is defined in asipRobot.h, 
+ * so the motor service, PID and profiles can be exercised without a robot.
+ * MotorSim has no hardware dependencies, it advances in virtual time by the interval given to step, 
+ * so the plant can also be stepped faster than real time by a host test program.
+ */
+
+#ifndef MotorSim_h
+#define MotorSim_h
+#include "Arduino.h"
+
+const uint32_t MOTOR_SIM_STEP = 100; // integration step in microseconds
+
+typedef struct {
+   float supplyVoltage;   // volts at full PWM
+   float resistance;      // armature resistance, ohms
+   float torqueConstant;  // Nm per amp, also back-EMF volts per rad/sec
+   float inertia;         // kg m^2 at the motor shaft, including the reflected wheel and robot load
+   float viscousFriction; // Nm per rad/sec at the motor shaft
+   float coulombFriction; // Nm at the motor shaft, the motor does not start until torque exceeds this
+   float gearRatio;       // motor turns per wheel turn
+   int   ticksPerRev;     // encoder ticks per wheel turn
+   int   maxPwm;          // PWM value that applies the full supply voltage
+} motorSimParams_t;
+
+extern const motorSimParams_t defaultMotorSimParams; // values for the motors in RobotDescription.h
+
+class MotorSim
+{
+    public:
+        MotorSim(const motorSimParams_t &params);
+        void reset();
+        void setPwm(int pwm);              // +- maxPwm
+        void step(uint32_t intervalMicros); // advance the simulation
+        int32_t getPosition();             // encoder count
+        void setPosition(int32_t position);
+        uint32_t getEdgeMicros();          // virtual time of most recent count change
+        uint32_t getMicros();              // virtual time
+        uint8_t getQuadratureState();      // encoder pins: bit 0 is pin A, bit 1 is pin B 
+        float getWheelSpeed();             // radians per second
+
+    private:
+        motorSimParams_t params;
+        int pwm;
+        float omega;          // motor speed, rad per sec
+        float wheelAngle;     // radians since position was set 
+        int32_t positionOffset; 
+        int32_t position;
+        uint32_t simMicros;
+        uint32_t edgeMicros;
+};
+
+/*
+ * Provides the read and write methods of the Encoder library using counts from a MotorSim.
+ * The simulation is advanced to the current time each time it is read.
+ */
+class SimEncoder
+{
+    public:
+        SimEncoder(MotorSim *motor);
+        void begin();
+        int32_t read();
+        int32_t read(uint32_t &edgeMicros);  // as ENCODER_EDGE_TIMES version of Encoder
+        void write(int32_t position);
+    private:
+        void update();
+        MotorSim *motor;
+        uint32_t startMicros; // micros time at virtual time 0
+};
+
+#endif
@@ -0,0 +1,69 @@
+/* Odometry.cpp
+ * Dead reckoning for a differential drive robot from wheel encoder counts.
+ * The increment for each frame is calculated in floating point using the 
+ * heading at the middle of the frame and accumulated in the fixed point pose.
+ */
+
+#include "Odometry.h"
+
+const float MICRO = 1000000.0;
+
+Odometry::Odometry(float wheelCircumference, float wheelTrack, int ticksPerRev)
+{
+   mmPerTick = wheelCircumference / ticksPerRev;
+   this->wheelTrack = wheelTrack;
+   reset();
+}
+
+void Odometry::reset()
+{
+   pose.x = pose.y = pose.theta = 0;
+   pose.velocity = pose.omega = 0;
+}
+
+void Odometry::update(int32_t leftTicks, int32_t rightTicks, uint32_t intervalMicros)
+{
+   float left = leftTicks * mmPerTick;
+   float right = rightTicks * mmPerTick;
+   updateBody((left + right) / 2, 0, (right - left) / wheelTrack, intervalMicros);
+}
+
+// dx is forward and dy is to the left of the heading at the start of the frame
+void Odometry::updateBody(float dx, float dy, float rotation, uint32_t intervalMicros)
+{
+   float heading = pose.theta / MICRO + rotation / 2;
+   float c = cos(heading);
+   float s = sin(heading);
+   pose.x += (int32_t)((dx * c - dy * s) * 1000);
+   pose.y += (int32_t)((dx * s + dy * c) * 1000);
+   int32_t theta = pose.theta + (int32_t)(rotation * MICRO);
+   const int32_t PI_MICRO = (int32_t)(PI * MICRO);
+   if( theta > PI_MICRO)
+      theta -= 2 * PI_MICRO;
+   else if( theta < -PI_MICRO)
+      theta += 2 * PI_MICRO;
+   pose.theta = theta;
+   if( intervalMicros > 0) {
+      pose.velocity = (int32_t)(dx * 1000 * (MICRO / intervalMicros));
+      pose.omega = (int32_t)(rotation * MICRO * (MICRO / intervalMicros));
+   }
+}
+
+// replaces the velocities calculated in update with a better estimate of wheel speeds 
+void Odometry::setWheelSpeeds(int32_t leftTicksPerSec, int32_t rightTicksPerSec, int scale)
+{
+   float left = leftTicksPerSec * mmPerTick / scale;    // mm per second
+   float right = rightTicksPerSec * mmPerTick / scale;
+   setBodySpeeds((left + right) / 2, (right - left) / wheelTrack);
+}
+
+void Odometry::setBodySpeeds(float velocity, float omega)
+{
+   pose.velocity = (int32_t)(velocity * 1000);
+   pose.omega = (int32_t)(omega * MICRO);
+}
+
+const pose_t &Odometry::getPose()
+{
+   return pose;
+}
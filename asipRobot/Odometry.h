@@ -0,0 +1,36 @@
+/* Odometry.h
+ * Dead reckoning for a differential drive robot from wheel encoder counts,
+ * other drive layouts pass the body motion from their kinematics to updateBody.
+ * Pose is held in fixed point: position in micrometers, heading in microradians
+ */
+
+#ifndef Odometry_h
+#define Odometry_h
+#include "Arduino.h"
+
+typedef struct {
+   int32_t x;         // micrometers, positive is forward from the start position 
+   int32_t y;         // micrometers, positive is to the left
+   int32_t theta;     // microradians, counter clockwise, in the range +- PI
+   int32_t velocity;  // body velocity in micrometers per second
+   int32_t omega;     // rotation rate in microradians per second
+} pose_t;
+
+class Odometry
+{
+    public:
+        Odometry(float wheelCircumference, float wheelTrack, int ticksPerRev); // dimensions in mm
+        void reset();
+        void update(int32_t leftTicks, int32_t rightTicks, uint32_t intervalMicros); // encoder counts since previous update
+        void setWheelSpeeds(int32_t leftTicksPerSec, int32_t rightTicksPerSec, int scale); // speeds are ticks per second * scale
+        void updateBody(float dx, float dy, float rotation, uint32_t intervalMicros); // mm and radians in the robot frame
+        void setBodySpeeds(float velocity, float omega);  // mm per second and radians per second
+        const pose_t &getPose();
+
+    private:
+        float mmPerTick;
+        float wheelTrack;
+        pose_t pose;
+};
+
+#endif
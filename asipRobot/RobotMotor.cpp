@@ -8,16 +8,19 @@
 
 #include "RobotMotor.h" 
 #include "RobotDescription.h"  // for wheel circumference
+#include "MotorSim.h"
 #include "utility/asip_debug.h"
       
 RobotMotor::RobotMotor(pinArray_t pins[])
 {
    this->pins = pins;  
+   sim = NULL;
    PID = new MotorPID(ENCODER_TICKS_PER_WHEEL_REV,MAX_PWM, MAX_PWM_DELTA); 
 }
 
 RobotMotor::RobotMotor()
 {
+   sim = NULL;
    PID = new MotorPID(ENCODER_TICKS_PER_WHEEL_REV,MAX_PWM, MAX_PWM_DELTA); 
 }
 
@@ -30,14 +33,11 @@ void RobotMotor::begin(const int direction, pinArray_t *pins)
 void RobotMotor::begin(const int direction)
 {
  debug_printf("motor using pins %d,%d,%d\n", pins[0], pins[1], pins[2]) ;  
- // NOTE teensy can use non DRV8833  so H-Bridge type must be set explicitly  
-#if defined (UNO_WIFI_REV2_328MODE) || defined (TARGET_RP2040) || defined(TARGET_RASPBERRY_PI_PICO) || defined(ARDUINO_ARCH_ESP32)
-  setHbridgeType(_DRV8833); // drv8833 uses pwm so no need to set pinmode  
-#endif  
+  hBridge.begin(pins); // the H-bridge policy is selected in HBridge.h 
   //pinMode(standbyPin, OUTPUT);
   
   motorDirectionMode = (int)direction ; // flag to set rotation when moving forward 
-  targetPwm = currentPwm = 0; 
+  targetPwm = currentPwm = requestedPwm = 0; 
   motorBrakeMode = false;  // freewheel
   motorStandbyMode = 0;
   stopMotor();
@@ -45,12 +45,7 @@ void RobotMotor::begin(const int direction)
 
 void RobotMotor::setHbridgeType(int type)
 {
-  hBridgeType = type;
-  if(type!= _DRV8833){
-    // DRV8833 uses analogWrite so no need for pinMode
-    pinMode(pins[in1Pin], OUTPUT);
-    pinMode(pins[in2Pin], OUTPUT);
-  }    
+  hBridge.setType(type);
   //Serial.printf("motor using pins %d,%d,%d set to H-bridge type %d\n", pins[0], pins[1], pins[2], type) ; 
 }
 
@@ -60,6 +55,18 @@ void RobotMotor::setMotorLabel(const char *labelString) // for debug print only
    PID->label = label;
 }
 
+void RobotMotor::setSimulation(MotorSim *sim)
+{
+   this->sim = sim;
+}
+
+inline void RobotMotor::simulatePwm(int pwm)
+{
+   if( sim != NULL) {
+      sim->setPwm(requestedPwm < 0 ? -pwm : pwm);
+   }
+}
+
 void RobotMotor::setBrakeMode(boolean brakeMode)
 {
   // true shorts motor when stopped, false freewheels
@@ -93,6 +100,7 @@ void RobotMotor::stopMotor()
   //stop the motor using the current braking mode 
   setMotorPwm(0);
   PID->stopPid();
+  profile.stop();
   currentPwm = 0;
   debug_printf("%s stopMotor\n", label);
 }
@@ -116,44 +124,32 @@ void RobotMotor::setMotorPower(int power) // 0-100%
 
 void RobotMotor::setMotorPwm(int requestedPwm)
 {
-  // Serial.print("H bridge type = "); Serial.println(hBridgeType);
-  int motorDirection; 
-  targetPwm = abs(constrain(requestedPwm, -MAX_PWM, MAX_PWM) );
-  if( hBridgeType == _DRV8833){
-      // Serial.print("requestedPwm ");  Serial.println(requestedPwm); 
-      bool isReverse = requestedPwm < 0;
-      bool isInverted = (motorDirection == -1);
-      int modeVal = motorBrakeMode? 0 : 255; // value written to non pwm pin dependent on brake mode
-      if( isInverted ^ isReverse ^ motorBrakeMode) {
-          // here if any one or all three are true
-          analogWrite(pins[in2Pin], modeVal);
-          //pins[PWMPin] = pins[in1Pin];
-          pwmPin = pins[in1Pin];
-          //Serial.printf("In %s setPwm, writing %d to pin %d, PWM pin is %d\n", label, modeVal, pins[in2Pin], pwmPin);
-      }
-      else{
-          analogWrite(pins[in1Pin], modeVal);
-          //pins[PWMPin] = pins[in2Pin]; 
-          pwmPin = pins[in2Pin];
-          //Serial.printf("In %s setPwm , writing %d to pin %d, PWM pin is %d\n", label, modeVal, pins[in1Pin], pwmPin);
-      }
-  }
-  else{
-    pwmPin = pins[PWMPin];
-    if( requestedPwm >= 0)
-       motorDirection = NORMAL_DIRECTION;
-    else
-       motorDirection = REVERSED_DIRECTION;     
-    digitalWrite(pins[in1Pin],  !(motorDirection * motorDirectionMode  == 1)? 1:0 );
-    //invert the direction for the second control line
-    digitalWrite(pins[in2Pin], (motorDirection * motorDirectionMode == 1)? 1:0 );
-    //debug_printf("in setMotor: %s pin %d is %d, %d is %d\n", label, pins[in1Pin], digitalRead(pins[in1Pin]),pins[in2Pin], digitalRead(pins[in2Pin])  );
-  }
-   isRampingPwm();  // control power ramp  
-  //debug_printf("in setMotor: %s pwm=%d, targetPwm=%d, dir=%d, dir mode=%d, dir mask=%d\n", label, pwm, targetPwm, motorDirection, motorDirectionMode, (motorDirectionMode ==1));     
+  this->requestedPwm = constrain(requestedPwm, -MAX_PWM, MAX_PWM);
+  targetPwm = abs(this->requestedPwm);
+  int motorDirection = requestedPwm >= 0 ? NORMAL_DIRECTION : REVERSED_DIRECTION;
+  hBridge.setDirection(motorDirection * motorDirectionMode != 1, motorBrakeMode);
+  isRampingPwm();  // control power ramp  
+  //debug_printf("in setMotor: %s targetPwm=%d, dir=%d, dir mode=%d\n", label, targetPwm, motorDirection, motorDirectionMode);     
 }
 
 
+boolean RobotMotor::isMoving()
+{
+  return requestedPwm != 0 || PID->isPidActive();
+}
+
+boolean RobotMotor::rampDown(int pwmStep)
+{
+  PID->stopPid();
+  profile.stop();
+  if( abs(requestedPwm) <= pwmStep) {
+    stopMotor();
+    return true;
+  }
+  setMotorPwm(requestedPwm > 0 ? requestedPwm - pwmStep : requestedPwm + pwmStep);
+  return false;
+}
+
 /*
  * Function to limit motor spin-up acceleration 
  * needed to prevent motor from drawing too much current at startup 
@@ -162,19 +158,12 @@ void RobotMotor::setMotorPwm(int requestedPwm)
 boolean RobotMotor::isRampingPwm() // returns true if motor coming up to speed
 {
   if( currentPwm >= targetPwm){
-    if(hBridgeType == _DRV8833 && motorBrakeMode == false){ // false is DRV8833 coast mode, so invert the PWM
-        analogWrite(pwmPin, 255-targetPwm);
-        //debug_printf("in isRampingPwm (inverted), %s writing %d to pin %d but returns false: currentPwm (%d) is >=  targetPwm (%d)\n", label, 255-targetPwm, pwmPin,  currentPwm, targetPwm);
-    }
-    else{
-      analogWrite(pwmPin, targetPwm);
-      //debug_printf("in isRampingPwm, %s writing %d to pin %d, but returning false because currentPwm (%d) is >=  targetPwm (%d)\n", label, targetPwm, pwmPin, currentPwm, targetPwm);
-   }
+    hBridge.setDuty(targetPwm, motorBrakeMode);  // only written if changed
+    simulatePwm(targetPwm);
     return false;  // motor is getting requested pwm level
   }
-#ifndef EXTERNAL_PID_SCHEDULAR  
+  // ramp is timed here so the rate does not depend on how often the control loop calls this
   if( millis() - prevPwmRampTime >= POWER_RAMP_INTERVAL)  
-#endif  
   { 
    // increase power at controlled rate   
    debug_printf("%s PWM ramp from %d ", label, currentPwm);
@@ -182,12 +171,8 @@ boolean RobotMotor::isRampingPwm() // returns true if motor coming up to speed
    if( currentPwm > targetPwm){
          currentPwm = targetPwm;
    }
-    if(hBridgeType == _DRV8833 && motorBrakeMode == false){ // false is DRV8833 coast mode, so invert the PWM
-        analogWrite(pwmPin, 255-currentPwm);
-    }
-    else {
-       analogWrite(pwmPin, currentPwm);
-   }
+   hBridge.setDuty(currentPwm, motorBrakeMode);
+   simulatePwm(currentPwm);
    debug_printf("to %d\n", currentPwm);
    prevPwmRampTime = millis();
   }   
@@ -199,7 +184,17 @@ void RobotMotor::setMotorRPM(int RPM, uint32_t duration)
 {                                                   
   if( abs(RPM) > 0 ) {
       int32_t targetTicksPerSecond = int32_t(((int32_t)RPM * ENCODER_TICKS_PER_WHEEL_REV) / 60 );      
-      PID->startPid(targetTicksPerSecond, duration);
+      if( profile.isEnabled()) {
+          // a timed move is planned as the distance it would cover at the requested speed  
+          int32_t distance = 0;
+          if( (long)duration > 0) {
+              distance = (int32_t)((float)targetTicksPerSecond * duration / 1000);
+          }
+          startProfile(targetTicksPerSecond, distance);
+      }
+      else {
+          PID->startPid(targetTicksPerSecond, duration);
+      }
       debug_printf("%s %s, ticksPerSecond set to %d, dur=%d\n",
                    label, RPM >= 0 ? "forward":"reversed",targetTicksPerSecond, duration );
   }       
@@ -207,3 +202,44 @@ void RobotMotor::setMotorRPM(int RPM, uint32_t duration)
     stopMotor();
   }      
 }
+
+void RobotMotor::moveTicks(int RPM, int32_t ticks) 
+{
+  int32_t targetTicksPerSecond = int32_t(((int32_t)abs(RPM) * ENCODER_TICKS_PER_WHEEL_REV) / 60 );      
+  if( targetTicksPerSecond == 0 || ticks == 0) {
+      stopMotor();
+  }
+  else if( profile.isEnabled()) {
+      startProfile(ticks > 0 ? targetTicksPerSecond : -targetTicksPerSecond, ticks);
+  }
+  else {
+      uint32_t duration = (abs(ticks) * 1000L) / targetTicksPerSecond;
+      PID->startPid(ticks > 0 ? targetTicksPerSecond : -targetTicksPerSecond, duration);
+  }
+}
+
+void RobotMotor::startProfile(int32_t targetTicksPerSecond, int32_t distance)
+{
+  if( !PID->isPidActive()) {
+      PID->startPid(0, -1); // the profile sets the speed and ends the move
+  }
+  profile.start(targetTicksPerSecond, distance);
+}
+
+void RobotMotor::setProfileLimits(float accel, float jerk)
+{
+  profile.setLimits(accel, jerk);
+}
+
+void RobotMotor::serviceProfile(uint32_t intervalMicros, int32_t deltaTicks)
+{
+  if( profile.isActive()) {
+      float velocity = profile.update(intervalMicros, deltaTicks);
+      if( profile.isFinished()) {
+          stopMotor();
+      }
+      else {
+          PID->setTarget((long)velocity);
+      }
+  }
+}
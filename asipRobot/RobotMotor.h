@@ -8,10 +8,10 @@
 #define RobotMotor_h
 #include "Arduino.h"
 #include "MotorPid.h"
+#include "MotionProfile.h"
+#include "HBridge.h"
 
-typedef byte pinArray_t;
-
-enum motorPinIndex {in1Pin,in2Pin,PWMPin,EncApin,EncBpin};
+class MotorSim;
 
 const int NORMAL_DIRECTION    = 1;
 const int REVERSED_DIRECTION  = -1;
@@ -21,9 +21,8 @@ const int DIR_REVERSE         = -1;
 
 const int  MAX_PWM = 255; // maximum PWM value supported by hardware
 const int  MAX_PWM_DELTA     = 80;  // max percent increase in power between intervals 
-const int  POWER_RAMP_INTERVAL = 30;  // interval between incriments in ms, not used if ASIP controls frame rate
+const int  POWER_RAMP_INTERVAL = 30;  // interval between incriments in ms
   
-enum hBridgeType {_TB6612FNG, _DRV8833};
 enum boardType {_UnknownBoard, _Mirto2016Board, _Mirto2018Board, _MirtoUnoWifiBoard};
   
 class RobotMotor
@@ -34,7 +33,7 @@ class RobotMotor
         //RobotMotor(int In1Pin, int In2Pin, int PWMPin, int STBYPin);
         void begin(const int direction);  
         void begin(const int direction, pinArray_t *pins ); // used for auto board detect
-        void setHbridgeType(int type);
+        void setHbridgeType(int type);  // only used if HBRIDGE_POLICY is SelectableHBridgePolicy
         void setBrakeMode(boolean brakeMode);
         void stopMotor();
         void setStandbyMode(boolean standbyMode);
@@ -42,26 +41,36 @@ class RobotMotor
         //int getDirection(); // range +-MAX_PWM, positive is forward
         void setMotorPower(int MPower); // range is -100 to 100                
         void setMotorRPM(int RPM, uint32_t duration); // duration in ms 
+        void moveTicks(int RPM, int32_t ticks);       // move the given number of encoder ticks, sign sets direction
+        void setProfileLimits(float accel, float jerk); // ticks per sec per sec, and per sec cubed, accel of 0 disables
+        void serviceProfile(uint32_t intervalMicros, int32_t deltaTicks); // call before servicing the PID
         void setMotorPwm(int pwm);        
         void setMotorLabel(const char *label); // for debug print only  
+        void setSimulation(MotorSim *sim); // the PWM driven to the motor is also given to this simulation
         boolean isRampingPwm(); // returns true if motor coming up to speed          
+        boolean isMoving();     // true if motor has power or PID is active
+        boolean rampDown(int pwmStep); // stops PID and reduces power by pwmStep, returns true when stopped
         MotorPID *PID; // todo - make private?
         const char *label; // only used for debug print to identify motor    ;
         
     private:
         void initialise();
+        void startProfile(int32_t targetTicksPerSecond, int32_t distance);
         int powerToPWM(int power);
         int targetPwm;  // the absolute value of the requested PWM
         int currentPwm; // most recent PWM driven by ramping acceleration limiter
+        int requestedPwm; // signed value of most recent setMotorPwm
         int motorDirectionMode;  //1 normal dir, -1 dir inverted
         int motorBrakeMode;  // 0 off, 1 on
         boolean motorStandbyMode;
         //pin assignments: In1, In2, PWM, encoderA, encoderB
         byte *pins;
-        byte pwmPin;
         int standbyPin;
         uint32_t prevPwmRampTime;           // time of most increse in PWM to control rate motor comes up to speed      
-        int hBridgeType;
+        HBridge<HBRIDGE_POLICY> hBridge;  // caches pin writes so unchanged values are not rewritten
+        MotionProfile profile;
+        void simulatePwm(int pwm);  // pwm actually driven, sign is direction
+        MotorSim *sim;
 
 };
 #endif
@@ -26,6 +26,7 @@
 #else     
     #error("Hardware not suppported")
 #endif
+// encoderPins has the A and B pins for each motor in motor order, add pins for the rear wheels if NBR_MOTORS is 4
 // Separate arrays are a requirement of the third party encoder library 
 #define encoderLeftPins  (&encoderPins[0])
 #define encoderRightPins (&encoderPins[2])
@@ -14,6 +14,7 @@
 #include "Robot_pins.h"
 #include "RobotDescription.h"
 #include "RobotMotor.h"
+#include "EncoderVelocity.h"
 #include <Encoder.h>
 
 #include "config.h"
@@ -23,38 +24,85 @@
 #endif
 
 
-//declare two encoder objects
-static Encoder encoderLeftWheel(encoderPins[0], encoderPins[1]);
-static Encoder encoderRightWheel(encoderPins[2], encoderPins[3]);
-static Encoder *encoders[2] = {&encoderLeftWheel, &encoderRightWheel};
+// lists an expression for each wheel, NBR_MOTORS is 2 or 4 
+#if NBR_MOTORS == 4
+#define FOR_EACH_WHEEL(f)  f(0), f(1), f(2), f(3)
+#else
+#define FOR_EACH_WHEEL(f)  f(0), f(1)
+#endif
+
+#ifdef MOTOR_SIMULATION
+#include "MotorSim.h"
+#pragma message("MOTOR_SIMULATION is defined, motors and encoders are simulated")  // defined in asipRobot.h
+// simulated motors, the encoders read the counts from these
+#define SIM_MOTOR(i)    MotorSim(defaultMotorSimParams)
+#define SIM_ENCODER(i)  SimEncoder(&motorSim[i])
+static MotorSim motorSim[NBR_WHEELS] = { FOR_EACH_WHEEL(SIM_MOTOR) };
+static SimEncoder encoders[NBR_WHEELS] = { FOR_EACH_WHEEL(SIM_ENCODER) };
+#else
+// an encoder for each wheel, the A and B pins for wheel i are encoderPins[2*i] and encoderPins[2*i+1] 
+static_assert(sizeof(encoderPins) / sizeof(encoderPins[0]) >= 2 * NBR_WHEELS, "encoderPins in Robot_pins.h needs 2 pins for each motor");
+#define WHEEL_ENCODER(i)  Encoder(encoderPins[2*(i)], encoderPins[2*(i)+1])
+static Encoder encoders[NBR_WHEELS] = { FOR_EACH_WHEEL(WHEEL_ENCODER) };
+#endif
 
 static boolean encoderEventsFlag = true; // true enables encoder events
 
-// left and right motor instances
-static RobotMotor wheel[NBR_WHEELS] = 
-{
-  // RobotMotor constructor  (pins and method to read encoder now passed in wheel begin method)
-  RobotMotor(),
-  RobotMotor()
-};
+// motor instances (pins and method to read encoder are passed in wheel begin method)
+#define WHEEL_MOTOR(i)  RobotMotor()
+static RobotMotor wheel[NBR_WHEELS] = { FOR_EACH_WHEEL(WHEEL_MOTOR) };
+
+// wheel speed estimates used by the PID and odometry
+static EncoderVelocity wheelVelocity[NBR_WHEELS];
+
+// relay feedback tuning of one wheel at a time
+static RelayAutoTune autoTune;
+
+// PID values for each wheel are batched here when telemetry is enabled
+static pidTelemetry_t telemetry[TELEMETRY_BATCH_SIZE][NBR_WHEELS];
+
+// pose is integrated from the encoder counts each PID frame
+static Odometry odometry(WHEEL_CIRCUMFERENCE, WHEEL_TRACK, ENCODER_TICKS_PER_WHEEL_REV);
+
+// default kinematics for the number of motors, use setKinematics for mecanum wheels  
+#if NBR_MOTORS == 4
+static SkidSteerKinematics defaultKinematics(WHEEL_TRACK);
+#else
+static DifferentialKinematics defaultKinematics(WHEEL_TRACK);
+#endif
 
-const char *motorLabels[NBR_WHEELS] = {"left ", "Right"};  //just for debug messages, 
+const float MM_PER_TICK = WHEEL_CIRCUMFERENCE / ENCODER_TICKS_PER_WHEEL_REV;
 
-// static callbacks to enable PID to set motor PWM 
-static void leftMotorCallback(int pwm)
+const char *motorLabels[] = {"left ", "Right", "RearL", "RearR"};  //just for debug messages, 
+
+// static callbacks to enable PID to set motor PWM, one is instantiated for each wheel 
+template <int i> static void motorCallback(int pwm)
 {   
-   wheel[0].setMotorPwm(pwm);
+   wheel[i].setMotorPwm(pwm);
 }  
 
-static void rightMotorCallback(int pwm)
-{
-    wheel[1].setMotorPwm(pwm); 
-} 
+#define WHEEL_CALLBACK(i)  motorCallback<i>
+static const motorPwmFunc motorCallbacks[NBR_WHEELS] = { FOR_EACH_WHEEL(WHEEL_CALLBACK) };
   
 robotMotorClass::robotMotorClass(const char svcId, const char evtId)
   :asipServiceClass(svcId)
 {
   svcName = PSTR("Motors");
+  controlInterval = 0;
+  poseEventsFlag = false;
+  syncEnabled = true;
+  syncActive = false;
+  syncGain = DEFAULT_SYNC_GAIN;
+  tuneWheel = -1;
+  telemetryDecimation = 0;
+  telemetryCount = 0;
+  telemetrySeq = 0;
+  watchdogTimeout = 0;
+  watchdogStopping = false;
+  kinematics = &defaultKinematics;
+  lineSensor = NULL;
+  lineFollowActive = false;
+  commandCount = 0;
 }
 
 /*
@@ -64,6 +112,10 @@ robotMotorClass::robotMotorClass(const char svcId, const char evtId)
  */
  void robotMotorClass::begin(byte nbrElements, byte motorPinCount, pinArray_t pins[], byte encoderPinCount, const pinArray_t encoderPins[])
 {
+  if( motorPinCount < 3 * NBR_WHEELS || encoderPinCount < 2 * NBR_WHEELS) {
+    debug_printf("!motors not started, %d wheels need %d motor pins and %d encoder pins\n", NBR_WHEELS, 3 * NBR_WHEELS, 2 * NBR_WHEELS);
+    return;
+  }
   asipServiceClass::begin(nbrElements,motorPinCount,pins, encoderPinCount, encoderPins);
   if (restoreConfig() == false) // try and retrieve saved PID from eeprom
   {
@@ -73,15 +125,24 @@ robotMotorClass::robotMotorClass(const char svcId, const char evtId)
   for(int i=0; i < NBR_WHEELS; i++) {
      wheel[i].setDirectionMode(0); //Direction Mode determines how the wheel responds to positive and negative motor power values 
      wheel[i].setBrakeMode(0);     //Sets the brake mode to zero - freewheeling mode - so wheels are easy to turn by hand
-     wheel[i].PID->initPid(configData.Kp, configData.Ki, configData.Kd, configData.Ko );
+     pidGains_t &gains = configData.wheel[i < CONFIG_NBR_WHEELS ? i : 0];
+     wheel[i].PID->initPid(gains.Kp, gains.Ki, gains.Kd, gains.Ko );
      ///wheel[i].encoderResetCume();
      wheel[i].setMotorLabel(motorLabels[i]); // just for debug messages, can be removed
-     encoders[i]->begin();  // use modified encoder library that attaches interrupts in the begin method, not constructor 
+     encoders[i].begin();  // use modified encoder library that attaches interrupts in the begin method, not constructor 
+#ifdef MOTOR_SIMULATION
+     wheel[i].setSimulation(&motorSim[i]);
+#endif
   }
 
-  wheel[0].begin(NORMAL_DIRECTION,&pins[0]); 
-  wheel[1].begin(NORMAL_DIRECTION,&pins[3]);
-  setAutoreport(1000/PID_FRAME_HZ);  // motor autoreport must be set for encoder events and PID 
+  for(int i=0; i < NBR_WHEELS; i++) {
+     wheel[i].begin(NORMAL_DIRECTION,&pins[i*3]); 
+  }
+#ifdef ASIP_PID 
+  setMotionLimits(DEFAULT_ACCEL_LIMIT, DEFAULT_JERK_LIMIT);
+#endif
+  setControlRate(configData.controlHz);
+  setAutoreport(1000/PID_FRAME_HZ);  // motor autoreport must be set for encoder events 
 }
 
 /*
@@ -98,17 +159,25 @@ robotMotorClass::robotMotorClass(const char svcId, const char evtId)
      wheel[i].setDirectionMode(0); //Direction Mode determines how the wheel responds to positive and negative motor power values 
      wheel[i].setBrakeMode(0);     //Sets the brake mode to zero - freewheeling mode - so wheels are easy to turn by hand
   }
-  wheel[0].begin(REVERSED_DIRECTION); // robot moves forward with positive values
-  wheel[1].begin(NORMAL_DIRECTION);
-  
-  wheel[0].setMotorLabel("Left "); // just for debug, can be removed 
-  wheel[1].setMotorLabel("Right"); // as above
+  for(int i=0; i < NBR_WHEELS; i++) {
+     // robot moves forward with positive values
+     wheel[i].begin(i % 2 == 0 ? REVERSED_DIRECTION : NORMAL_DIRECTION); // left wheels are reversed
+     wheel[i].setMotorLabel(motorLabels[i]); // just for debug, can be removed 
+  }
 }
 
 void robotMotorClass::setHbridgeType(int type)
 {
-  wheel[0].setHbridgeType(type);
-  wheel[1].setHbridgeType(type);
+  for(int i=0; i < NBR_WHEELS; i++) {
+     wheel[i].setHbridgeType(type);
+  }
+}
+
+void robotMotorClass::setKinematics(Kinematics *kinematics)
+{
+  if( kinematics != NULL && kinematics->getWheelCount() == NBR_WHEELS) {
+     this->kinematics = kinematics;
+  }
 }
 
 
@@ -133,8 +202,8 @@ void robotMotorClass::reset()
 void robotMotorClass::refreshEncoderCache(int side)
 {
    // update encoder values   
-   if( side < 2) { 
-       encoder_state[side].pos = encoders[side]->read(); // todo adjust sign by multiply by motor direction
+   if( side < NBR_WHEELS) { 
+       encoder_state[side].pos = encoders[side].read(); // todo adjust sign by multiply by motor direction
        encoder_state[side].delta = encoder_state[side].pos - encoder_state[side].prevPos;
        encoder_state[side].prevPos = encoder_state[side].pos; 
 
@@ -142,22 +211,282 @@ void robotMotorClass::refreshEncoderCache(int side)
    }
 }
 
-// reportValues services PID and reports encoder events if encoderEventsFlag is true
+// the control loop runs from tick at its own rate, or from reportValues if the control rate is 0 
+void robotMotorClass::tick(Stream *stream)
+{
+   if( controlInterval > 0 && micros() - prevFrameMicros >= controlInterval) {
+       serviceControl(stream);
+   }
+}
+
+void robotMotorClass::setControlRate(int framesPerSecond)
+{
+   if( framesPerSecond <= 0) {
+       controlInterval = 0;  // PID serviced each encoder event 
+       controlHz = 0;
+   }
+   else {
+       controlHz = constrain(framesPerSecond, 1, MAX_PID_FRAME_HZ);
+       controlInterval = 1000000L / controlHz;
+   }
+   prevFrameMicros = micros();
+   for(int i=0; i < NBR_WHEELS; i++) {
+       controlPrevPos[i] = encoders[i].read();
+       wheelVelocity[i].reset(controlPrevPos[i], prevFrameMicros);
+       if( controlInterval > 0) {
+           wheel[i].PID->setExternalScheduling(true);  // frames are timed here
+           wheel[i].PID->setFrameInterval(controlInterval);
+       }
+       else {
+#ifdef EXTERNAL_PID_SCHEDULAR
+           wheel[i].PID->setExternalScheduling(true);  // serviced with each encoder event
+#else
+           wheel[i].PID->setExternalScheduling(false); // the PID times its own frames
+           wheel[i].PID->setFrameInterval(1000000L / PID_FRAME_HZ);
+#endif
+       }
+   }
+   debug_printf("control interval set to %d us\n", controlInterval);
+}
+
+void robotMotorClass::serviceControl(Stream *stream)
+{
+   int32_t pos[NBR_WHEELS];
+   int32_t delta[NBR_WHEELS];
+   int32_t velocity[NBR_WHEELS];
+   uint32_t edgeMicros[NBR_WHEELS];
+   for(int i=0; i < NBR_WHEELS; i++) {
+#ifdef ENCODER_EDGE_TIMES
+       pos[i] = encoders[i].read(edgeMicros[i]);
+#else
+       pos[i] = encoders[i].read();
+#endif
+   }
+   uint32_t now = micros();  // read after the encoders so no edge is later than now
+   uint32_t interval = now - prevFrameMicros;
+   prevFrameMicros = now;
+   for(int i=0; i < NBR_WHEELS; i++) {
+       delta[i] = pos[i] - controlPrevPos[i];
+       controlPrevPos[i] = pos[i];
+#ifndef ENCODER_EDGE_TIMES
+       edgeMicros[i] = now; // edges are timed to the control frame  
+#endif
+       velocity[i] = wheelVelocity[i].update(pos[i], edgeMicros[i], now);
+   }
+   for(int i=0; i < NBR_WHEELS; i++) {
+       wheel[i].isRampingPwm();  // motor acceleration control 
+       wheel[i].serviceProfile(interval, delta[i]);  // set PID targets for this frame
+   }
+   if( lineFollowActive) {
+       serviceLineFollow(interval, stream);
+   }
+   serviceSync(delta);
+   serviceWatchdog(interval, stream);
+#ifdef ASIP_PID 
+   if( tuneWheel >= 0) {
+       serviceAutoTune(velocity[tuneWheel], now, stream);
+   }
+#endif
+   float travel[NBR_WHEELS];  // mm since previous frame
+   float speed[NBR_WHEELS];   // mm per second
+   for(int i=0; i < NBR_WHEELS; i++) {
+       if( wheel[i].PID->isPidServiceNeeded())
+           if(!wheel[i].PID->servicePid(velocity[i], motorCallbacks[i]))
+               wheel[i].stopMotor();   
+       travel[i] = delta[i] * MM_PER_TICK;
+       speed[i] = velocity[i] * MM_PER_TICK / VELOCITY_SCALE;
+   }
+#ifdef ASIP_PID 
+   if( telemetryDecimation > 0) {
+       captureTelemetry(stream);  // after the PID so samples hold this frame's values
+   }
+#endif
+   float dx, dy, rotation;
+   kinematics->toBody(travel, dx, dy, rotation);
+   odometry.updateBody(dx, dy, rotation, interval);
+   kinematics->toBody(speed, dx, dy, rotation);
+   odometry.setBodySpeeds(dx, rotation);
+}
+
+// reportValues reports encoder events if encoderEventsFlag is true
 void robotMotorClass::reportValues(Stream *stream)
 {
-   wheel[0].isRampingPwm();  // motor acceleration control 
-   wheel[1].isRampingPwm();
-   refreshEncoderCache(0);
-   if( wheel[0].PID->isPidServiceNeeded())
-       if(!wheel[0].PID->servicePid(encoder_state[0].delta, leftMotorCallback))
-           wheel[0].stopMotor();   
-   refreshEncoderCache(1);
-   if( wheel[1].PID->isPidServiceNeeded())
-       if(!wheel[1].PID->servicePid(encoder_state[1].delta, rightMotorCallback))
-           wheel[1].stopMotor();
+   if( controlInterval == 0) {
+       serviceControl(stream);
+   }
+   for(int i=0; i < NBR_WHEELS; i++) {
+       refreshEncoderCache(i);
+   }
    if(encoderEventsFlag) {
        asipServiceClass::reportValues(stream);        
    }   
+   if(poseEventsFlag) {
+       reportPose(stream);
+   }
+}
+
+void robotMotorClass::setWatchdog(unsigned int timeout)
+{
+   watchdogTimeout = timeout;
+   prevRequestMillis = millis();
+}
+
+// ramps motors to stop if the host has not sent a request within the watchdog timeout
+void robotMotorClass::serviceWatchdog(uint32_t intervalMicros, Stream *stream)
+{
+   if( watchdogStopping) {
+       int step = max(1L, (long)(((uint32_t)MAX_PWM * (intervalMicros / 100)) / (WATCHDOG_RAMP_TIME * 10L)));
+       boolean isStopped = true;
+       for(int i=0; i < NBR_WHEELS; i++) {
+           if( !wheel[i].rampDown(step)) {
+               isStopped = false;
+           }
+       }
+       if( isStopped) {
+           watchdogStopping = false;
+           stopSync();
+       }
+   }
+   else if( watchdogTimeout > 0 && millis() - prevRequestMillis >= watchdogTimeout) {
+       boolean isMoving = false;
+       for(int i=0; i < NBR_WHEELS; i++) {
+           isMoving |= wheel[i].isMoving();
+       }
+       if( isMoving) {
+           watchdogStopping = true;
+           stopLineFollow();
+#ifdef ASIP_PID 
+           stopAutoTune();
+#endif
+           stream->write(EVENT_HEADER);
+           stream->write(ServiceId);
+           stream->write(',');
+           stream->write(tag_WATCHDOG_EVENT);
+           stream->write(',');
+           stream->print(millis() - prevRequestMillis);
+           stream->write(MSG_TERMINATOR);
+       }
+       prevRequestMillis = millis();  // check again after another timeout period
+   }
+}
+
+void robotMotorClass::setLineSensor(irLineSensorClass *lineSensor)
+{
+   this->lineSensor = lineSensor;
+}
+
+uint16_t robotMotorClass::getCommandCount()
+{
+   return commandCount;
+}
+
+void robotMotorClass::stopLineFollow()
+{
+   if( lineFollowActive) {
+       lineFollowActive = false;
+       lineSensor->setSampleInterval(0);
+   }
+}
+
+#ifdef ASIP_PID 
+/*
+ * Line following closes the steering loop on the robot at the control rate.
+ * The turn rate is proportional to the line position and its rate of change, 
+ * the kinematics converts speed and turn rate into a PID target for each wheel.
+ */
+boolean robotMotorClass::startLineFollow(int speed, int Kp, int Kd)
+{
+   if( lineSensor == NULL) {
+       return false;
+   }
+   stopMotors();
+   if( speed != 0) {
+       lineSpeed = speed;
+       lineKp = Kp;
+       lineKd = Kd;
+       lineSensor->getLinePosition(prevLinePosition);
+       lineSensor->setSampleInterval(LINE_FOLLOW_SAMPLE_INTERVAL);
+       lineSeenMillis = millis();
+       for(int i=0; i < NBR_WHEELS; i++) {
+           wheel[i].PID->startPid(0, -1); // runs until stopped, targets are set each frame
+       }
+       lineFollowActive = true;
+       debug_printf("line follow at %d mm/s, Kp=%d, Kd=%d\n", speed, Kp, Kd);
+   }
+   return true;
+}
+#endif
+
+void robotMotorClass::serviceLineFollow(uint32_t intervalMicros, Stream *stream)
+{
+   for(int i=0; i < NBR_WHEELS; i++) {
+       if( !wheel[i].PID->isPidActive()) {
+           debug_printf("line follow stopped, wheel %d PID is not active\n", i);
+           stopMotors();  // a wheel has auto-stopped so the robot can no longer steer
+           return;
+       }
+   }
+   int position;
+   if( lineSensor->getLinePosition(position)) {
+       lineSeenMillis = millis();
+   }
+   else if( millis() - lineSeenMillis >= LINE_LOST_TIMEOUT) {
+       stopMotors();
+       stream->write(EVENT_HEADER);
+       stream->write(ServiceId);
+       stream->write(',');
+       stream->write(tag_LINE_LOST_EVENT);
+       stream->write(',');
+       stream->print(millis() - lineSeenMillis);
+       stream->write(MSG_TERMINATOR);
+       return;
+   }
+   long rate = intervalMicros > 0 ? (long)(position - prevLinePosition) * 100000L / intervalMicros : 0; // change per 100ms
+   prevLinePosition = position;
+   float dps = ((long)lineKp * position + (long)lineKd * rate) / 1000.0;  // positive turns clockwise, toward the line
+   float speed[NBR_WHEELS];  // mm per second
+   kinematics->toWheels(lineSpeed, 0, -dps * DEG_TO_RAD, speed);
+   for(int i=0; i < NBR_WHEELS; i++) {
+       wheel[i].PID->setTarget((long)(speed[i] / MM_PER_TICK));
+   }
+}
+
+void robotMotorClass::resetPose()
+{
+   odometry.reset();
+}
+
+const pose_t &robotMotorClass::getPose()
+{
+   return odometry.getPose();
+}
+
+int robotMotorClass::getWheelRPM(byte wheel)
+{
+   if( wheel < NBR_WHEELS) {
+       return (int)((wheelVelocity[wheel].getVelocity() * 60L) / ((long)ENCODER_TICKS_PER_WHEEL_REV * VELOCITY_SCALE));
+   }
+   return 0;
+}
+
+void robotMotorClass::reportPose(Stream *stream)
+{
+   const pose_t &pose = odometry.getPose();
+   stream->write(EVENT_HEADER);
+   stream->write(ServiceId);
+   stream->write(',');
+   stream->write(tag_POSE_EVENT);
+   stream->write(',');
+   stream->print(pose.x / 1000);
+   stream->write(',');
+   stream->print(pose.y / 1000);
+   stream->write(',');
+   stream->print(pose.theta / 1000);
+   stream->write(',');
+   stream->print(pose.velocity / 1000);
+   stream->write(',');
+   stream->print(pose.omega / 1000);
+   stream->write(MSG_TERMINATOR);
 }
 
 void robotMotorClass::reportValue(int sequenceId, Stream * stream)  // send the value of the given device
@@ -171,57 +500,372 @@ void robotMotorClass::reportValue(int sequenceId, Stream * stream)  // send the
   
 void robotMotorClass::setMotorPower(byte motor, int power)
 {
+   commandCount++;
+   stopSync();
+   stopLineFollow();
    if(motor < NBR_WHEELS){       
        wheel[motor].setMotorPower(power);
        debug_printf("Motor %d set to %d\n", motor, power);
    }
 }
 
-void robotMotorClass::setMotorPowers(int power0, int power1)
+void robotMotorClass::setMotorPowers(const int power[])
 {
-  // TODO this assumes only two motors
-   setMotorPower(0, power0);
-   setMotorPower(1, power1);
+   for(int i=0; i < NBR_WHEELS; i++) {
+       setMotorPower(i, power[i]);
+   }
 }
 
 #ifdef ASIP_PID 
 void robotMotorClass::setMotorRPM(byte motor, int rpm, long duration)
 {
+   commandCount++;
+   stopSync();
+   stopLineFollow();
    if(motor < NBR_WHEELS){      
        wheel[motor].setMotorRPM(rpm, duration);
        debug_printf("Motor %d rpm set to %d for %d ms\n", motor, rpm, duration);
    }
 }
 
-void robotMotorClass::setMotorsRPM(int rpm0, int rpm1, long duration)
+void robotMotorClass::setMotorsRPM(const int rpm[], long duration)
 {
-  // TODO this assumes only two motors
-   setMotorRPM(0, rpm0, duration);
-   setMotorRPM(1, rpm1, duration);
+   for(int i=0; i < NBR_WHEELS; i++) {
+       setMotorRPM(i, rpm[i], duration);
+   }
+   startSync(rpm);
 }
 
-
 void robotMotorClass::setRobotSpeedCmPerSec(int cmps, long duration)
 {
-  int rpm = (int)(60 * cmps) / (WHEEL_CIRCUMFERENCE / 10.0); // circumference is in mm 
-  //debug_printf.printf("set rpm to %d for a speed of %d cm per sec, dur=%ld\n", rpm, cmps, duration);
-  setMotorsRPM(rpm, rpm, duration);  
+  setRobotVelocity(cmps * 10, 0, 0, duration);  
+}
+
+// the kinematics converts the body velocity into the speed of each wheel
+// positive dps turns clockwise, as in rotateRobot
+void robotMotorClass::setRobotVelocity(int vx, int vy, int dps, long duration)
+{
+  float speed[NBR_WHEELS];  // mm per second
+  int rpm[NBR_WHEELS];
+  kinematics->toWheels(vx, vy, -dps * DEG_TO_RAD, speed);
+  for(int i=0; i < NBR_WHEELS; i++) {
+      rpm[i] = (int)(60 * speed[i] / WHEEL_CIRCUMFERENCE); // circumference is in mm 
+  }
+  //debug_printf("set velocity %d,%d mm/s %d dps for %ld ms\n", vx, vy, dps, duration);
+  setMotorsRPM(rpm, duration);  
 }
    
 void robotMotorClass::rotateRobot( int dps, int angle)
 {  
-  long dur = abs((angle * 1000L) / dps);  
-  int distance = TRACK_CIRCUMFERENCE * angle / 360.0; // distance in mm
-  int speed = distance * 100L / dur; // absolute wheel speed in cm per sec 
-  dur =  distance *100L / speed; // recalculated because speed in cm/sec is rounded down. 
-  int rpm = (int)(60 * speed) / (WHEEL_CIRCUMFERENCE / 10.0); 
-  //debug_printf("\nRotateAngle: dps= %d, angle=%d, dur= %ld, speed=%d cm/sec, distance = %d cm, RPM=%d\n", dps,angle, dur, speed, distance, rpm); 
-  setMotorsRPM(rpm, -rpm, dur);    
+  float travel[NBR_WHEELS]; // mm each wheel moves to turn the robot through the angle
+  float speed[NBR_WHEELS];  // mm per second
+  int rpm[NBR_WHEELS];
+  kinematics->toWheels(0, 0, -angle * DEG_TO_RAD, travel);  // positive angles turn clockwise
+  kinematics->toWheels(0, 0, abs(dps) * DEG_TO_RAD, speed);
+  commandCount++;
+  stopSync();
+  stopLineFollow();
+  for(int i=0; i < NBR_WHEELS; i++) {
+      // profiled moves stop at this count rather than after a time
+      int32_t ticks = (int32_t)(travel[i] / MM_PER_TICK);
+      rpm[i] = (int)(60 * fabs(speed[i]) / WHEEL_CIRCUMFERENCE);
+      wheel[i].moveTicks(rpm[i], ticks);
+      if( ticks < 0) {
+          rpm[i] = -rpm[i]; // sign gives the direction for sync
+      }
+  }
+  //debug_printf("\nRotateAngle: dps= %d, angle=%d, RPM=%d\n", dps, angle, rpm[0]); 
+  startSync(rpm);
+}
+
+void robotMotorClass::setMotionLimits(int accel, int jerk)
+{
+   const float ticksPerMm = ENCODER_TICKS_PER_WHEEL_REV / WHEEL_CIRCUMFERENCE;
+   for(int i=0; i < NBR_WHEELS; i++) {
+       wheel[i].setProfileLimits(accel * ticksPerMm, jerk * ticksPerMm);
+   }
+   debug_printf("motion limits: accel %d mm/s/s, jerk %d mm/s/s/s\n", accel, jerk);
+}
+
+boolean robotMotorClass::setPidGains(byte motor, int Kp, int Ki, int Kd, int Ko)
+{
+   if(motor < NBR_WHEELS && Ko > 0){      
+       int oldKp, oldKi, oldKd, oldKo;
+       unsigned long interval;
+       wheel[motor].PID->getPid(oldKp, oldKi, oldKd, oldKo, interval);
+       wheel[motor].PID->updatePid(Kp, Ki, Kd, Ko, interval);
+       return true;
+   }
+   return false;
+}
+
+void robotMotorClass::reportPidGains(byte motor, Stream *stream)
+{
+   if(motor < NBR_WHEELS){      
+       int Kp, Ki, Kd, Ko;
+       unsigned long interval;
+       wheel[motor].PID->getPid(Kp, Ki, Kd, Ko, interval);
+       stream->write(EVENT_HEADER);
+       stream->write(ServiceId);
+       stream->write(',');
+       stream->write(tag_PID_GAINS_EVENT);
+       stream->write(',');
+       stream->print(motor);
+       stream->write(',');
+       stream->print(Kp);
+       stream->write(',');
+       stream->print(Ki);
+       stream->write(',');
+       stream->print(Kd);
+       stream->write(',');
+       stream->print(Ko);
+       stream->write(',');
+       stream->print(controlHz);
+       stream->write(MSG_TERMINATOR);
+   }
+   else {
+       reportError(ServiceId, tag_GET_PID_GAINS, ERR_INVALID_DEVICE_NUMBER, stream);
+   }
+}
+
+boolean robotMotorClass::savePidGains()
+{
+   for(int i=0; i < NBR_WHEELS && i < CONFIG_NBR_WHEELS; i++) {
+       int Kp, Ki, Kd, Ko;
+       unsigned long interval;
+       wheel[i].PID->getPid(Kp, Ki, Kd, Ko, interval);
+       configData.wheel[i].Kp = Kp;
+       configData.wheel[i].Ki = Ki;
+       configData.wheel[i].Kd = Kd;
+       configData.wheel[i].Ko = Ko;
+   }
+   configData.controlHz = controlHz;
+   return saveConfig();
+}
+
+/*
+ * Relay auto-tune drives one wheel directly, the PID for that wheel is stopped until tuning ends.
+ * The proposed gains are sent in an autotune event, use tag_SET_PID_GAINS to apply them.
+ */
+void robotMotorClass::startAutoTune(byte motor, int rpm, int pwm)
+{
+   stopAutoTune();
+   if(motor < NBR_WHEELS && rpm != 0 && pwm != 0){      
+       stopMotors();
+       int32_t setpoint = ((int32_t)rpm * ENCODER_TICKS_PER_WHEEL_REV) / 60; 
+       tuneWheel = motor;
+       tuneDir = rpm > 0 ? 1 : -1;
+       // with a control rate of 0 the PID runs with the encoder events at the default rate
+       autoTune.start(setpoint, constrain(abs(pwm), 1, MAX_PWM * 2 / 3), controlHz > 0 ? controlHz : PID_FRAME_HZ, micros());
+       debug_printf("autotune wheel %d at %d ticks per sec\n", motor, setpoint);
+   }
+}
+
+void robotMotorClass::stopAutoTune()
+{
+   if( tuneWheel >= 0) {
+       autoTune.stop();
+       wheel[tuneWheel].stopMotor();
+       tuneWheel = -1;
+   }
+}
+
+void robotMotorClass::serviceAutoTune(int32_t velocity, uint32_t now, Stream *stream)
+{
+   int pwm = autoTune.update(velocity / VELOCITY_SCALE, now);
+   autoTuneState_t state = autoTune.getState();
+   if( state == AUTOTUNE_RUNNING) {
+       wheel[tuneWheel].setMotorPwm(pwm * tuneDir);
+   }
+   else {
+       const autoTuneResult_t &result = autoTune.getResult();
+       stream->write(EVENT_HEADER);
+       stream->write(ServiceId);
+       stream->write(',');
+       stream->write(tag_AUTOTUNE_EVENT);
+       stream->write(',');
+       stream->print(tuneWheel);
+       stream->write(',');
+       if( state == AUTOTUNE_DONE) {
+           stream->print("1,");
+           stream->print(result.Kp);
+           stream->write(',');
+           stream->print(result.Ki);
+           stream->write(',');
+           stream->print(result.Kd);
+           stream->write(',');
+           stream->print(result.Ko);
+           stream->write(',');
+           stream->print(result.period / 1000);
+           stream->write(',');
+           stream->print(result.amplitude);
+       }
+       else {
+           stream->print("0,0,0,0,0,0,0"); // no oscillation found
+       }
+       stream->write(MSG_TERMINATOR);
+       stopAutoTune();
+   }
+}
+
+void robotMotorClass::setTelemetry(int decimation, int format)
+{
+   telemetryDecimation = max(decimation, 0);
+   telemetryFormat = format == TELEMETRY_BINARY ? TELEMETRY_BINARY : TELEMETRY_TEXT;
+   telemetryFrameCount = telemetryCount = 0;
+}
+
+void robotMotorClass::captureTelemetry(Stream *stream)
+{
+   if( ++telemetryFrameCount >= telemetryDecimation) {
+       telemetryFrameCount = 0;
+       for(int i=0; i < NBR_WHEELS; i++) {
+           telemetry[telemetryCount][i] = wheel[i].PID->getTelemetry();
+       }
+       if( ++telemetryCount >= TELEMETRY_BATCH_SIZE) {
+           sendTelemetry(stream);
+           telemetryCount = 0;
+       }
+   }
+}
+
+static void writeInt16(Stream *stream, int16_t value)
+{
+   stream->write(lowByte(value));
+   stream->write(highByte(value));
+}
+
+void robotMotorClass::sendTelemetry(Stream *stream)
+{
+   stream->write(EVENT_HEADER);
+   stream->write(ServiceId);
+   stream->write(',');
+   if( telemetryFormat == TELEMETRY_BINARY) {
+       stream->write(tag_TELEMETRY_BINARY);
+       stream->write(',');
+       stream->print(3 + telemetryCount * NBR_WHEELS * 13);
+       stream->write(',');
+       writeInt16(stream, telemetrySeq);
+       stream->write(telemetryCount);
+       for(int f=0; f < telemetryCount; f++) {
+           for(int i=0; i < NBR_WHEELS; i++) {
+               pidTelemetry_t &t = telemetry[f][i];
+               writeInt16(stream, t.target);
+               writeInt16(stream, t.input);
+               writeInt16(stream, t.error);
+               writeInt16(stream, t.iTerm);
+               writeInt16(stream, t.pid);
+               writeInt16(stream, t.output);
+               stream->write(t.flags);
+           }
+       }
+   }
+   else {
+       stream->write(tag_TELEMETRY_EVENT);
+       stream->write(',');
+       stream->print(telemetrySeq);
+       stream->write(',');
+       stream->print(telemetryCount);
+       stream->write(",{");
+       for(int f=0; f < telemetryCount; f++) {
+           for(int i=0; i < NBR_WHEELS; i++) {
+               pidTelemetry_t &t = telemetry[f][i];
+               stream->print(t.target);
+               stream->write(':');
+               stream->print(t.input);
+               stream->write(':');
+               stream->print(t.error);
+               stream->write(':');
+               stream->print(t.iTerm);
+               stream->write(':');
+               stream->print(t.pid);
+               stream->write(':');
+               stream->print(t.output);
+               stream->write(':');
+               stream->print(t.flags);
+               if( i < NBR_WHEELS-1)
+                   stream->write(':');
+           }
+           if( f < telemetryCount-1)
+               stream->write(',');
+       }
+       stream->write('}');
+   }
+   stream->write(MSG_TERMINATOR);
+   telemetrySeq++;
+}
+
+void robotMotorClass::setWheelSync(boolean enable, int gain)
+{
+   syncEnabled = enable;
+   syncGain = gain;
+   if( !enable) {
+       stopSync();
+   }
 }
 #endif
 
+/*
+ * Wheel synchronization for moves where all wheels turn at the same speed.
+ * The difference between the ticks moved by each wheel and the average of
+ * the other wheels since the start of the move adjusts the PID targets, slowing
+ * wheels that are ahead and speeding up those that are behind, so heading 
+ * is held without help from the host. 
+ */
+void robotMotorClass::startSync(const int rpm[])
+{
+   stopSync();
+   if( !syncEnabled || rpm[0] == 0) {
+       return;
+   }
+   for(int i=0; i < NBR_WHEELS; i++) {
+       if( abs(rpm[i]) != abs(rpm[0])) {
+           return;  // wheels at different speeds are not synchronized
+       }
+       syncDir[i] = rpm[i] > 0 ? 1 : -1;
+       syncTicks[i] = 0;
+   }
+   syncActive = true;
+}
+
+void robotMotorClass::stopSync()
+{
+   if( syncActive) {
+       syncActive = false;
+       for(int i=0; i < NBR_WHEELS; i++) {
+           wheel[i].PID->setTargetTrim(0);
+       }
+   }
+}
+
+void robotMotorClass::serviceSync(int32_t delta[])
+{
+   if( syncActive) {
+       long total = 0;
+       for(int i=0; i < NBR_WHEELS; i++) {
+           if( !wheel[i].PID->isPidActive()) {
+               stopSync();  // a wheel has finished its move
+               return;
+           }
+           syncTicks[i] += delta[i];
+           total += syncDir[i] * syncTicks[i];
+       }
+       for(int i=0; i < NBR_WHEELS; i++) {
+           long progress = syncDir[i] * syncTicks[i];
+           long error = progress - (total - progress) / (NBR_WHEELS - 1); // positive if this wheel is ahead of the others
+           wheel[i].PID->setTargetTrim(-error * syncGain * syncDir[i]);
+       }
+   }
+}
+
 void robotMotorClass::stopMotor(byte motor)
 {
+   commandCount++;
+   stopSync();
+   stopLineFollow();
+#ifdef ASIP_PID 
+   stopAutoTune();
+#endif
    if(motor < NBR_WHEELS){
        wheel[motor].stopMotor();
        debug_printf("Motor %d stopped\n", motor);
@@ -230,6 +874,12 @@ void robotMotorClass::stopMotor(byte motor)
 
 void robotMotorClass::stopMotors()
 {
+    commandCount++;
+    stopSync();
+    stopLineFollow();
+#ifdef ASIP_PID 
+    stopAutoTune();
+#endif
     for(int i=0; i < NBR_WHEELS; i++ ){
         wheel[i].stopMotor();
     }    
@@ -238,55 +888,194 @@ void robotMotorClass::stopMotors()
 void robotMotorClass::resetEncoderTotals()
 {
     debug_printf("resetting encoder counts\n");
-    encoderLeftWheel.write(0);
-    encoderRightWheel.write(0);
-    encoder_state[0].prevPos = encoder_state[1].prevPos = 0;
+    for(int i=0; i < NBR_WHEELS; i++) {
+        encoders[i].write(0);
+        encoder_state[i].prevPos = 0;
+        controlPrevPos[i] = 0;
+        wheelVelocity[i].reset(0, micros());
+    }
 }
    
 void robotMotorClass::processRequestMsg(Stream *s)
 {
    int request = s->read();    
+   prevRequestMillis = millis(); // any request resets the watchdog 
+   if( request != tag_KEEPALIVE) {
+       watchdogStopping = false; // and any request other than keepalive takes control from a watchdog stop
+   }
 
    if(request == tag_AUTOEVENT_REQUEST) {
        // unlike other services, motor autoevents is always on, this request enables or disable the sending of encoder data
-        encoderEventsFlag = (s->parseInt()!= 0);  
+       // values above 1 also set the event interval in ms
+        int value = s->parseInt();
+        encoderEventsFlag = (value != 0);  
+        if( value > 1) {
+            setAutoreport(value);
+        }
    }
    else{ 
       // invoke request with correct number of args
        switch(request) { 
           case tag_SET_MOTOR:  setMotorPower(s->parseInt(), s->parseInt());  break;
-          case tag_SET_MOTORS: setMotorPowers(s->parseInt(), s->parseInt());break; // TODO this assumes only two motors
+          case tag_SET_MOTORS: 
+              {
+                  int power[NBR_WHEELS];
+                  for(int i=0; i < NBR_WHEELS; i++) {
+                      power[i] = s->parseInt();
+                  }
+                  setMotorPowers(power);
+              }
+              break; 
 #ifdef ASIP_PID           
           case tag_SET_MOTOR_RPM:  setMotorRPM(s->parseInt(), s->parseInt(), s->parseInt()); break;
-          case tag_SET_MOTORS_RPM: setMotorsRPM(s->parseInt(), s->parseInt(), s->parseInt()); break;   
+          case tag_SET_MOTORS_RPM: 
+              {
+                  int rpm[NBR_WHEELS];
+                  for(int i=0; i < NBR_WHEELS; i++) {
+                      rpm[i] = s->parseInt();
+                  }
+                  setMotorsRPM(rpm, s->parseInt());
+              }
+              break;   
+          case tag_SET_ROBOT_VELOCITY: 
+              {
+                  int vx = s->parseInt();
+                  int vy = s->parseInt();
+                  int dps = s->parseInt();
+                  long duration = s->parseInt();
+                  setRobotVelocity(vx, vy, dps, duration);
+              }
+              break;
           case tag_SET_ROBOT_SPEED_CM : setRobotSpeedCmPerSec(s->parseInt(), s->parseInt()); break; 
           case tag_ROTATE_ROBOT_ANGLE: rotateRobot(s->parseInt(), s->parseInt());  break ;
+          case tag_MOTION_LIMITS: 
+              {
+                  int accel = s->parseInt();
+                  int jerk = s->parseInt();
+                  setMotionLimits(accel, jerk);
+              }
+              break;
+          case tag_WHEEL_SYNC: 
+              {
+                  boolean enable = s->parseInt() != 0;
+                  int gain = s->parseInt();
+                  setWheelSync(enable, gain);
+              }
+              break;
+          case tag_SET_PID_GAINS: 
+              {
+                  // arguments are read in order before the gains are set
+                  int motor = s->parseInt();
+                  int Kp = s->parseInt();
+                  int Ki = s->parseInt();
+                  int Kd = s->parseInt();
+                  int Ko = s->parseInt();
+                  if( !setPidGains(motor, Kp, Ki, Kd, Ko)) {
+                      reportError(ServiceId, request, motor >= 0 && motor < NBR_WHEELS ? ERR_INVALID_MODE : ERR_INVALID_DEVICE_NUMBER, s);
+                  }
+              }
+              break;
+          case tag_GET_PID_GAINS: reportPidGains(s->parseInt(), s); break;
+          case tag_SAVE_PID_GAINS: 
+              if( !savePidGains()) {
+                  reportError(ServiceId, request, ERR_DEVICE_NOT_AVAILABLE, s);
+              }
+              break;
+          case tag_AUTOTUNE_PID: 
+              {
+                  int motor = s->parseInt();
+                  int rpm = s->parseInt();
+                  int pwm = s->parseInt();
+                  startAutoTune(motor, rpm, pwm);
+              }
+              break;
+          case tag_PID_TELEMETRY: 
+              {
+                  int decimation = s->parseInt();
+                  int format = s->parseInt();
+                  setTelemetry(decimation, format);
+              }
+              break;
+          case tag_LINE_FOLLOW: 
+              {
+                  int speed = s->parseInt();
+                  int Kp = s->parseInt();
+                  int Kd = s->parseInt();
+                  if( !startLineFollow(speed, Kp, Kd)) {
+                      reportError(ServiceId, request, ERR_DEVICE_NOT_AVAILABLE, s);
+                  }
+              }
+              break;
 #endif          
           case tag_STOP_MOTOR:  stopMotor(s->parseInt()); break;
           case tag_STOP_MOTORS: stopMotors(); break; 
           case tag_RESET_ENCODERS: resetEncoderTotals(); break;
+          case tag_GET_POSE: reportPose(s); break;
+          case tag_POSE_EVENTS: poseEventsFlag = (s->parseInt() != 0); break;
+          case tag_RESET_POSE: resetPose(); break;
+          case tag_SET_WATCHDOG: setWatchdog(s->parseInt()); break;
+          case tag_KEEPALIVE: break;
+          case tag_CONTROL_RATE: setControlRate(s->parseInt()); break;
           default: reportError(ServiceId, request, ERR_UNKNOWN_REQUEST, s);
        }       
    }
 }
 
 
+// bump state is captured in interrupt handlers so a collision is seen on the next pass of the service loop
+static pinArray_t bumpPins[MAX_BUMP_SENSORS];
+static volatile byte bumpState;       // bit for each sensor set when bumped (switch closed)
+static volatile boolean bumpChanged;
+
+static inline void readBump(byte sensor)
+{
+  if( digitalRead(bumpPins[sensor]) == LOW)
+     bumpState |= (1 << sensor);
+  else
+     bumpState &= ~(1 << sensor);
+  bumpChanged = true;
+}
+
+// static ISRs, one for each sensor
+static void ASIP_ISR_ATTR bumpIsr0() { readBump(0); }
+static void ASIP_ISR_ATTR bumpIsr1() { readBump(1); }
+static void ASIP_ISR_ATTR bumpIsr2() { readBump(2); }
+static void ASIP_ISR_ATTR bumpIsr3() { readBump(3); }
+
+static void (*bumpIsrs[MAX_BUMP_SENSORS])() = {bumpIsr0, bumpIsr1, bumpIsr2, bumpIsr3};
+
 bumpSensorClass::bumpSensorClass(const char svcId) : asipServiceClass(svcId)
 {
   svcName = PSTR("Bump Sensors");
+  motors = NULL;
+  reflexMode = BUMP_REFLEX_NONE;
+  isBackingOff = false;
+  changeEventsFlag = true;
+  isEventPending = false;
 }
 
+// pins that can not interrupt are polled in tick
 void bumpSensorClass::bumpSensorClass::begin(byte nbrElements, byte pinCount, const pinArray_t pins[])
 { 
+  nbrElements = min(nbrElements, MAX_BUMP_SENSORS);
   asipServiceClass::begin(nbrElements,pinCount,pins);
   for(int sw=0; sw < nbrElements; sw++) {
      pinMode(pins[sw], INPUT_PULLUP); 
+     bumpPins[sw] = pins[sw];
+     readBump(sw);
+     if( digitalPinToInterrupt(pins[sw]) != NOT_AN_INTERRUPT) {
+        attachInterrupt(digitalPinToInterrupt(pins[sw]), bumpIsrs[sw], CHANGE);
+     }
   }
+  prevState = bumpState;
+  bumpChanged = false;
 }
 
 void bumpSensorClass::reset()
 {
-
+  changeEventsFlag = true;
+  reflexMode = BUMP_REFLEX_NONE;
+  isBackingOff = false;
 }
 
 void bumpSensorClass::reportValue(int sequenceId, Stream * stream)  // send the value of the given device
@@ -298,12 +1087,110 @@ void bumpSensorClass::reportValue(int sequenceId, Stream * stream)  // send the
     }
 }
 
+boolean bumpSensorClass::isBumped(int sequenceId)
+{
+   return sequenceId < nbrElements && (bumpState & (1 << sequenceId));
+}
+
+void bumpSensorClass::setReflexMotors(robotMotorClass *motors)
+{
+   this->motors = motors;
+}
+
+void bumpSensorClass::setReflex(int mode, int power, int ms)
+{
+   reflexMode = mode <= BUMP_REFLEX_BACKOFF ? mode : BUMP_REFLEX_NONE;
+   reflexPower = constrain(abs(power), 0, 100);
+   reflexDuration = max(ms, 0);
+}
+
+void bumpSensorClass::tick(Stream *stream)
+{
+   for(int sw=0; sw < nbrElements; sw++) {
+      if( digitalPinToInterrupt(pins[sw]) == NOT_AN_INTERRUPT) {
+         boolean isClosed = digitalRead(pins[sw]) == LOW;
+         if( isClosed != ((bumpState & (1 << sw)) != 0)) {
+            noInterrupts();
+            readBump(sw);
+            interrupts();
+         }
+      }
+   }
+   if( bumpChanged) {
+      noInterrupts();
+      byte state = bumpState;
+      bumpChanged = false;
+      interrupts();
+      byte newBumps = state & ~prevState;
+      prevState = state;
+      for(int sw=0; sw < nbrElements; sw++) {
+         if( newBumps & (1 << sw)) {
+            startReflex(sw, stream);
+            break;
+         }
+      }
+      isEventPending = changeEventsFlag;
+   }
+   if( isEventPending && millis() - prevEventMillis >= BUMP_DEBOUNCE) {
+      isEventPending = false;
+      prevEventMillis = millis();
+      asipServiceClass::reportValues(stream);
+   }
+   if( isBackingOff && motors->getCommandCount() != reflexCommand) {
+      isBackingOff = false;  // the motors have been commanded since the bump
+   }
+   if( isBackingOff && millis() - reflexStartMillis >= (uint32_t)reflexDuration) {
+      isBackingOff = false;
+      motors->stopMotors();
+   }
+}
+
+// the reflex acts before the event is sent so the motors respond without waiting for the host
+void bumpSensorClass::startReflex(int sequenceId, Stream *stream)
+{
+   if( reflexMode == BUMP_REFLEX_NONE || motors == NULL) {
+      return;
+   }
+   motors->stopMotors();
+   if( reflexMode == BUMP_REFLEX_BACKOFF && reflexPower > 0 && reflexDuration > 0) {
+      int power[NBR_WHEELS];
+      for(int i=0; i < NBR_WHEELS; i++) {
+         power[i] = -reflexPower;
+      }
+      motors->setMotorPowers(power);
+      reflexCommand = motors->getCommandCount();
+      isBackingOff = true;
+      reflexStartMillis = millis();
+   }
+   stream->write(EVENT_HEADER);
+   stream->write(ServiceId);
+   stream->write(',');
+   stream->write(tag_BUMP_REFLEX_EVENT);
+   stream->write(',');
+   stream->print(sequenceId);
+   stream->write(',');
+   stream->print(reflexMode);
+   stream->write(MSG_TERMINATOR);
+}
+
 void bumpSensorClass::processRequestMsg(Stream *stream)
 {
    int request = stream->read();
    if(request == tag_AUTOEVENT_REQUEST) {
       setAutoreport(stream);
    }
+   else if(request == tag_BUMP_CHANGE_EVENTS) {
+      changeEventsFlag = (stream->parseInt() != 0);
+   }
+   else if(request == tag_BUMP_REFLEX) {
+      int mode = stream->parseInt();
+      int power = stream->parseInt();
+      int ms = stream->parseInt();
+      setReflex(mode, power, ms);
+      if( reflexMode != BUMP_REFLEX_NONE && motors == NULL) {
+         reportError(ServiceId, request, ERR_DEVICE_NOT_AVAILABLE, stream);
+      }
+   }
    else {
      reportError(ServiceId, request, ERR_UNKNOWN_REQUEST, stream);
    }
@@ -312,50 +1199,131 @@ void bumpSensorClass::processRequestMsg(Stream *stream)
 irLineSensorClass::irLineSensorClass(const char svcId) : asipServiceClass(svcId)
 {
    svcName = PSTR("IR Sensors");
+   isCalibrating = false;
+   phase = IR_IDLE;
+   lineEventsFlag = false;
+   lastPosition = 0;
+   sampleInterval = 0;
 }
 
 #define ON_STATE HIGH
 #define OFF_STATE LOW
 void irLineSensorClass::begin(byte nbrElements, byte pinCount, const pinArray_t pins[]) 
 {
+  nbrElements = min(nbrElements, IR_MAX_SENSORS);
   asipServiceClass::begin(nbrElements,pinCount,pins);
   if(pins[0] < 255){ 
     pinMode(pins[0], OUTPUT);
     digitalWrite(pins[0], OFF_STATE);
   }
+  for(int i=0; i < IR_MAX_SENSORS; i++) {
+    value[i] = 0;
+  }
 }
 
+// the values reported are from the most recent sweep completed in tick
 void irLineSensorClass::reportValues(Stream *stream) 
 {
-   if(pins[0] < 255){ 
-     // turn on IR emitters
-     digitalWrite(pins[0], ON_STATE);
-     delayMicroseconds(200); // reduced delay time 1 July 2014
-   }
    asipServiceClass::reportValues(stream);
-    // turn off IR emitters
-   if(pins[0] < 255){  
-     digitalWrite(pins[0], OFF_STATE);
+   if( lineEventsFlag) {
+      reportLinePosition(stream);
    }
 }
 
 void irLineSensorClass::reset()
 {
+   isCalibrating = false;
+   if( phase != IR_IDLE && pins[0] < 255) {
+     digitalWrite(pins[0], OFF_STATE);
+   }
+   phase = IR_IDLE;
+}
+
+int irLineSensorClass::readSensor(int sequenceId)
+{
+   int pin = pins[sequenceId+1]; // the first pin is the control pin
+   #if defined(TARGET_RP2040) || defined(TARGET_RASPBERRY_PI_PICO)
+   #else
+     pin = PIN_TO_ANALOG(pin); // convert digital number to analog
+   #endif
+   return analogRead(pin);
+}
+
+/*
+ * Each sensor is read with the emitters off and then on. Reflected light pulls the
+ * reading down from full scale, ambient light pulls both readings down by the same amount,
+ * so adding back the drop seen with the emitters off leaves only the reflected IR. 
+ * A sweep is split into steps run on successive calls to tick so sampling never
+ * waits for the emitters or for more than one conversion.
+ */
+void irLineSensorClass::startSweep()
+{
+   channel = 0;
+   phase = pins[0] < 255 ? IR_AMBIENT : IR_LIT; // no ambient reading without emitter control
+}
+
+void irLineSensorClass::serviceSweep()
+{
+   switch(phase) {
+     case IR_AMBIENT:
+       sweep[channel] = readSensor(channel);
+       if( ++channel >= nbrElements) {
+         // turn on IR emitters
+         digitalWrite(pins[0], ON_STATE);
+         emitterOnMicros = micros();
+         phase = IR_SETTLING;
+       }
+       break;
+     case IR_SETTLING:
+       if( micros() - emitterOnMicros >= IR_SETTLE_MICROS) {
+         channel = 0;
+         phase = IR_LIT;
+       }
+       break;
+     case IR_LIT:
+       {
+         int reading = readSensor(channel);
+         if( pins[0] < 255) {
+           reading = constrain(reading + IR_FULL_SCALE - sweep[channel], 0, IR_FULL_SCALE);
+         }
+         sweep[channel] = reading;
+         if( ++channel >= nbrElements) {
+           completeSweep();
+         }
+       }
+       break;
+   }
+}
+
+void irLineSensorClass::completeSweep()
+{
+   if( pins[0] < 255) {
+     // turn off IR emitters
+     digitalWrite(pins[0], OFF_STATE);
+   }
+   for(int i=0; i < nbrElements; i++) {
+     if( isCalibrating) {
+       configData.ir.min[i] = min(configData.ir.min[i], (uint16_t)sweep[i]);
+       configData.ir.max[i] = max(configData.ir.max[i], (uint16_t)sweep[i]);
+     }
+     value[i] = normalise(i, sweep[i]);
+   }
+   phase = IR_IDLE;
+}
 
+int16_t irLineSensorClass::normalise(int sequenceId, int reading)
+{
+   int range = configData.ir.max[sequenceId] - configData.ir.min[sequenceId];
+   if( range > 0 && !isCalibrating) {
+     return constrain(((long)reading - configData.ir.min[sequenceId]) * 1000L / range, 0, 1000);
+   }
+   return constrain(reading - 24, 0, 1000);  // ensure max value <= 1000
 }
 
 int16_t irLineSensorClass::getValue(int sequenceId)
 {
     if( sequenceId < nbrElements) {
-      int pin = pins[sequenceId+1]; // the first pin is the control pin
-      #if defined(TARGET_RP2040) || defined(TARGET_RASPBERRY_PI_PICO)
-      #else
-        pin = PIN_TO_ANALOG(pin); // convert digital number to analog
-      #endif
-      int16_t value = analogRead(pin) -24;  // ensure max value <= 1000
-      if(value < 0)
-          value = 0;
-      return value;
+      return value[sequenceId];
     }
     return 0;
 }
@@ -365,12 +1333,144 @@ void irLineSensorClass::reportValue(int sequenceId, Stream * stream)  // send th
    stream->print(getValue(sequenceId));
 }
 
+// sensors are sampled here, so values are ready when events, calibration or line following need them
+void irLineSensorClass::tick(Stream *stream)
+{
+   if( phase != IR_IDLE) {
+      serviceSweep();
+   }
+   else {
+      int interval = sweepInterval();
+      if( interval >= 0 && millis() - prevSampleMillis >= (uint32_t)interval) {
+         prevSampleMillis = millis();
+         startSweep();
+      }
+   }
+}
+
+int irLineSensorClass::sweepInterval()
+{
+   if( isCalibrating) {
+      return IR_CALIBRATION_INTERVAL;
+   }
+   if( sampleInterval > 0) {
+      return sampleInterval;
+   }
+   if( autoInterval > 0) {
+      return 0;  // sweeps run back to back so each event has recent values
+   }
+   return -1;
+}
+
+void irLineSensorClass::setSampleInterval(int ms)
+{
+   sampleInterval = max(ms, 0);
+   prevSampleMillis = millis();
+}
+
+/*
+ * The line position is the centroid of the sensor values above IR_LINE_THRESHOLD,
+ * weighted by how far each value is above the threshold. 
+ * Sensor 0 is on the left, the first sensor is at position -500 * (nbrElements-1)
+ * A lost line is reported half a sensor spacing beyond the outermost sensor on the side it was last seen.
+ */
+boolean irLineSensorClass::getLinePosition(int &position)
+{
+   long weighted = 0;
+   long total = 0;
+   for(int i=0; i < nbrElements; i++) {
+     int weight = value[i] - IR_LINE_THRESHOLD;
+     if( weight > 0) {
+       weighted += (long)weight * i * 1000;
+       total += weight;
+     }
+   }
+   int edge = (nbrElements - 1) * 500;
+   if( total == 0) {
+     // line lost, report it beyond the sensor that saw it last
+     position = lastPosition < 0 ? -(edge + 500) : (lastPosition > 0 ? edge + 500 : 0);
+     return false;
+   }
+   position = weighted / total - edge;
+   lastPosition = position;
+   return true;
+}
+
+void irLineSensorClass::reportLinePosition(Stream *stream)
+{
+   int position;
+   boolean isFound = getLinePosition(position);
+   stream->write(EVENT_HEADER);
+   stream->write(ServiceId);
+   stream->write(',');
+   stream->write(tag_IR_LINE_EVENT);
+   stream->write(',');
+   stream->print(position);
+   stream->write(',');
+   stream->print(isFound ? 1 : 0);
+   stream->write(MSG_TERMINATOR);
+}
+
+// move the sensors over the line and the background after starting calibration
+void irLineSensorClass::startCalibration()
+{
+   for(int i=0; i < nbrElements; i++) {
+     configData.ir.min[i] = IR_FULL_SCALE;
+     configData.ir.max[i] = 0;
+   }
+   prevSampleMillis = millis();
+   isCalibrating = true;
+}
+
+boolean irLineSensorClass::endCalibration()
+{
+   isCalibrating = false;
+   return saveConfig();
+}
+
+void irLineSensorClass::reportCalibration(Stream *stream)
+{
+   stream->write(EVENT_HEADER);
+   stream->write(ServiceId);
+   stream->write(',');
+   stream->write(tag_IR_CALIBRATION_EVENT);
+   stream->write(',');
+   stream->print(nbrElements);
+   stream->write(",{");
+   for(int i=0; i < nbrElements; i++) {
+     stream->print(configData.ir.min[i]);
+     stream->write(':');
+     stream->print(configData.ir.max[i]);
+     if( i < nbrElements-1)
+       stream->write(',');
+   }
+   stream->write('}');
+   stream->write(MSG_TERMINATOR);
+}
+
 void irLineSensorClass::processRequestMsg(Stream *stream)
 {
    int request = stream->read();
    if(request == tag_AUTOEVENT_REQUEST) {
       setAutoreport(stream);
    }
+   else if(request == tag_IR_CALIBRATE) {
+      if( stream->parseInt() != 0) {
+        startCalibration();
+      }
+      else if( isCalibrating) {
+        if( !endCalibration()) {
+          reportError(ServiceId, request, ERR_DEVICE_NOT_AVAILABLE, stream); // calibration is used but not saved
+        }
+        reportCalibration(stream);
+      }
+   }
+   else if(request == tag_IR_GET_CALIBRATION) {
+      reportCalibration(stream);
+   }
+   else if(request == tag_IR_LINE_EVENTS) {
+      lineEventsFlag = (stream->parseInt() != 0);
+   }
    else {
      reportError(ServiceId, request, ERR_UNKNOWN_REQUEST, stream);
    }
@@ -14,9 +14,14 @@
 #define robot_h
 
 #define ASIP_PID  // comment this to disable PID code
+//#define MOTOR_SIMULATION // uncomment to replace motors and encoders with the simulation in MotorSim.h
+#define NBR_MOTORS 2    // 2 for differential drive, 4 for skid-steer or mecanum; encoderPins in Robot_pins.h needs 2 pins per motor
 
 #include "asip.h"
 #include "RobotMotor.h"  // for H-bridge enums
+#include "Odometry.h"
+#include "AutoTune.h"
+#include "Kinematics.h"
 
 #ifdef NOT_MOVED_TO_SKETCH  // include the appropriate one if not defined in sketch folder
 #if defined (UNO_WIFI_REV2_328MODE) || defined (ARDUINO_SAMD_ZERO) || defined(ARDUINO_UNOWIFIR4) // all use same shield
@@ -39,14 +44,38 @@
 const char id_MOTOR_SERVICE = 'M';
 // Motor methods (messages to Arduino)
 const char tag_SET_MOTOR            = 'm'; // sets motor power  
-const char tag_SET_MOTORS           = 'M';
+const char tag_SET_MOTORS           = 'M'; // power for each motor 
 const char tag_SET_MOTOR_RPM        = 'r'; // wheel rpm
-const char tag_SET_MOTORS_RPM       = 'R'; // both wheels rpm 
+const char tag_SET_MOTORS_RPM       = 'R'; // rpm for each wheel followed by the duration 
 const char tag_SET_ROBOT_SPEED_CM   = 'c'; // speed in Cm per Sec using PID
 const char tag_ROTATE_ROBOT_ANGLE   = 'a'; // Robot rotation using given degrees per second and angle 
+const char tag_SET_ROBOT_VELOCITY   = 'V'; // forward mm/sec, left mm/sec, degrees/sec clockwise, duration; left is ignored unless the drive is mecanum
 const char tag_STOP_MOTOR           = 's';  
 const char tag_STOP_MOTORS          = 'S';
 const char tag_RESET_ENCODERS       = 'E'; // rest total counts to zero
+const char tag_GET_POSE             = 'O'; // send a single pose event
+const char tag_POSE_EVENTS          = 'P'; // 1 sends a pose event with each encoder event, 0 disables
+const char tag_RESET_POSE           = 'Z'; // set pose to zero
+const char tag_CONTROL_RATE         = 'F'; // PID frames per second, 0 runs the PID with encoder events (legacy)
+const char tag_MOTION_LIMITS        = 'L'; // acceleration mm/sec/sec, jerk mm/sec/sec/sec for rpm, speed and rotate requests, 0 acceleration disables 
+const char tag_WHEEL_SYNC           = 'Y'; // enable (1) or disable (0) wheel synchronization, gain in ticks per sec per tick of error
+const char tag_SET_PID_GAINS        = 'K'; // wheel,Kp,Ki,Kd,Ko 
+const char tag_GET_PID_GAINS        = 'G'; // wheel, replies with a gains event
+const char tag_SAVE_PID_GAINS       = 'W'; // write gains of all wheels and the control rate to EEPROM
+const char tag_AUTOTUNE_PID         = 'U'; // wheel,rpm,pwm relay auto-tune at rpm with pwm switched by +-50%, rpm of 0 cancels 
+const char tag_PID_TELEMETRY        = 'T'; // decimation,format  send every nth control frame, 0 disables; format 0 is text, 1 is binary 
+const char tag_SET_WATCHDOG         = 'D'; // ms, motors ramp to stop if no motor request for this long, 0 disables
+const char tag_KEEPALIVE            = 'k'; // resets the watchdog without changing motors
+const char tag_LINE_FOLLOW          = 'f'; // speed mm/sec,Kp,Kd  follow the line seen by the IR service, speed 0 stops (see startLineFollow)
+// tag_AUTOEVENT_REQUEST: 0 disables encoder events, 1 enables, values above 1 enable with this interval in ms
+// Motor events
+const char tag_POSE_EVENT           = 'o'; // @M,o,x,y,theta,velocity,omega  mm, milliradians, mm/sec, milliradians/sec
+const char tag_PID_GAINS_EVENT      = 'g'; // @M,g,wheel,Kp,Ki,Kd,Ko,controlHz
+const char tag_TELEMETRY_EVENT      = 't'; // @M,t,seq,nbrFrames,{target:input:error:iTerm:pid:output:flags for each wheel,...}
+const char tag_TELEMETRY_BINARY     = 'b'; // @M,b,nbrBytes,<bytes>  seq (2 bytes), nbrFrames (1 byte), then 13 bytes per wheel per frame, LSB first
+const char tag_WATCHDOG_EVENT       = 'd'; // @M,d,ms  motors stopping because no request for ms milliseconds
+const char tag_AUTOTUNE_EVENT       = 'u'; // @M,u,wheel,isValid,Kp,Ki,Kd,Ko,periodMs,amplitude  amplitude in ticks per sec, gains are proposals only
+const char tag_LINE_LOST_EVENT      = 'l'; // @M,l,ms  line following stopped because the line was not seen for ms milliseconds
 
 
 typedef struct {
@@ -66,16 +95,54 @@ const char id_ENCODER_SERVICE = 'E';
 // Bump detect service
 const char id_BUMP_SERVICE = 'B';
 // Bump sensor methods - use system define, tag_AUTOEVENT_REQUEST ('A') to request autoevents
+const char tag_BUMP_CHANGE_EVENTS   = 'C'; // 1 sends an event as soon as a bump sensor changes (the default), 0 disables
+const char tag_BUMP_REFLEX          = 'R'; // mode,power,ms  motor response to a bump: 0 none, 1 stop, 2 reverse at power percent for ms then stop
 // Bump Sensor events -  events use system tag: tag_SERVICE_EVENT  ('e')
+const char tag_BUMP_REFLEX_EVENT    = 'r'; // @B,r,sensor,mode  sent when the reflex acts on a bump
+
+const byte MAX_BUMP_SENSORS = 4;   // each sensor needs its own ISR, increase this and add ISRs if more are needed
+const int  BUMP_DEBOUNCE    = 20;  // minimum ms between change events
+enum bumpReflex_t {BUMP_REFLEX_NONE, BUMP_REFLEX_STOP, BUMP_REFLEX_BACKOFF};
 
 
 // IR Line detect service
 const char id_IR_REFLECTANCE_SERVICE = 'R';
 // IR Line detect methods - use system define, tag_AUTOEVENT_REQUEST ('A') to request autoevents
+const char tag_IR_CALIBRATE           = 'C'; // 1 starts recording the min and max of each sensor, 0 ends and saves to EEPROM
+const char tag_IR_GET_CALIBRATION     = 'G'; // replies with a calibration event
+const char tag_IR_LINE_EVENTS         = 'L'; // 1 sends a line event after each sensor event, 0 disables
 // IR Line detect events -  events use system tag: tag_SERVICE_EVENT  ('e')
+//   values are 0 to 1000 between the calibrated min and max, uncalibrated sensors report the reading - 24
+const char tag_IR_CALIBRATION_EVENT   = 'c'; // @R,c,nbrSensors,{min:max,...}
+const char tag_IR_LINE_EVENT          = 'l'; // @R,l,position,isFound  position is 0 when centred, 1000 per sensor spacing, positive to the right
+
+const byte IR_MAX_SENSORS          = 5;    // must not be more than CONFIG_NBR_IR_SENSORS in Config.h
+const int  IR_FULL_SCALE           = 1023; // analogRead of a sensor in darkness
+const int  IR_CALIBRATION_INTERVAL = 10;   // ms between samples while calibrating
+const int  IR_SETTLE_MICROS        = 200;  // time for the sensors to respond after the emitters turn on
+const int  IR_LINE_THRESHOLD       = 200;  // sensors with values above this see the line 
+
+
+const int DEFAULT_ACCEL_LIMIT = 1000;   // mm per second per second
+const int DEFAULT_JERK_LIMIT  = 10000;  // mm per second per second per second
+
+const int DEFAULT_SYNC_GAIN   = 5;      // ticks per second correction for each tick one wheel is ahead
+
+const int TELEMETRY_BATCH_SIZE = 4;     // control frames sent in each telemetry event
+enum telemetryFormat_t {TELEMETRY_TEXT, TELEMETRY_BINARY};
+
+const int WATCHDOG_RAMP_TIME   = 250;    // ms for the watchdog to ramp motors from full power to stop
 
+const int LINE_FOLLOW_SAMPLE_INTERVAL = 5;   // ms between IR samples while following a line
+const int LINE_LOST_TIMEOUT           = 500; // ms without seeing the line before line following stops
 
-const int NBR_WHEELS = 2;  // defines the number of wheels (and encoders), note not tested with values other than 2
+class irLineSensorClass;
+
+const int NBR_WHEELS = NBR_MOTORS;  // the number of wheels (and encoders), storage for each wheel is sized by this
+
+#if NBR_MOTORS != 2 && NBR_MOTORS != 4
+#error "NBR_MOTORS must be 2 or 4"
+#endif
 
 class robotMotorClass : public asipServiceClass
 {  
@@ -87,24 +154,85 @@ public:
    void setHbridgeType(int type); // enum indicating h-bridge
    int boardDetect();  // enum indicating board
    void reset();
+   void setKinematics(Kinematics *kinematics); // must have NBR_WHEELS wheels, default is differential or skid-steer
    void refreshEncoderCache(int side);
    void reportValue(int sequenceId, Stream * stream) ; // send the value of the given device
    void reportValues(Stream *stream);   
+   void tick(Stream *stream);           // runs the control loop when it is decoupled from events
+   void setControlRate(int framesPerSecond); // 0 services PID with encoder events 
    void setMotorPower(byte motor, int power);
-   void setMotorPowers(int power0, int power1);
+   void setMotorPowers(const int power[]);  // NBR_WHEELS values
 #ifdef ASIP_PID 
    void setMotorRPM(byte motor, int rpm, long duration);
-   void setMotorsRPM(int rpm0, int rpm1, long duration);
+   void setMotorsRPM(const int rpm[], long duration);
    void setRobotSpeedCmPerSec(int cmps, long duration);  
+   void setRobotVelocity(int vx, int vy, int dps, long duration); // mm/sec forward and to the left, degrees per sec
    void rotateRobot( int dps, int angle);
+   void setMotionLimits(int accel, int jerk);  // mm/sec/sec and mm/sec/sec/sec, 0 accel disables profiles
+   void setWheelSync(boolean enable, int gain);
+   boolean setPidGains(byte motor, int Kp, int Ki, int Kd, int Ko); // false if the motor or Ko is not valid
+   void reportPidGains(byte motor, Stream *stream);
+   boolean savePidGains();  // false if the board has no EEPROM
+   void startAutoTune(byte motor, int rpm, int pwm);
+   void setTelemetry(int decimation, int format);
 #endif   
    void stopMotor(byte motor);
    void stopMotors();
    void resetEncoderTotals();
+   void resetPose();
+   const pose_t &getPose();  // fixed point pose, see Odometry.h
+   int getWheelRPM(byte wheel);  // from the encoder velocity estimate
+   void reportPose(Stream *stream);
+   void setWatchdog(unsigned int timeout); // ms, 0 disables
+   void setLineSensor(irLineSensorClass *lineSensor); // needed for line following 
+#ifdef ASIP_PID 
+   boolean startLineFollow(int speed, int Kp, int Kd); // false if there is no line sensor
+#endif   
+   void stopLineFollow(); // leaves the motors running 
+   uint16_t getCommandCount(); // changes each time the motors are commanded
    void processRequestMsg(Stream *stream);
  //  void reportName(Stream *stream);
  private:
-   Encoder_state_t encoder_state[NBR_WHEELS];
+   void serviceControl(Stream *stream);  // ramps power, services PID and updates odometry
+   void serviceAutoTune(int32_t velocity, uint32_t now, Stream *stream);
+   void stopAutoTune();
+   void serviceWatchdog(uint32_t intervalMicros, Stream *stream);
+   void serviceLineFollow(uint32_t intervalMicros, Stream *stream);
+   void captureTelemetry(Stream *stream);
+   void sendTelemetry(Stream *stream);
+   void startSync(const int rpm[]);      // starts if all wheels have the same speed 
+   void stopSync();
+   void serviceSync(int32_t delta[]);
+   Encoder_state_t encoder_state[NBR_WHEELS]; // counts since previous encoder event
+   int32_t controlPrevPos[NBR_WHEELS];        // encoder position at previous control frame
+   uint32_t prevFrameMicros;   // time of previous control frame 
+   uint32_t controlInterval;   // microseconds between control frames, 0 if serviced with events
+   int controlHz;              // the requested control rate, saved with the PID gains
+   int tuneWheel;              // wheel being auto-tuned, -1 if none
+   int tuneDir;                // 1 or -1 
+   int telemetryDecimation;    // control frames per telemetry frame, 0 if disabled
+   int telemetryFrameCount;    // frames since previous capture
+   byte telemetryCount;        // frames in the batch
+   byte telemetryFormat;
+   uint16_t telemetrySeq;      // incremented for each event so host can detect lost events
+   unsigned int watchdogTimeout; // ms, 0 if disabled
+   uint32_t prevRequestMillis;   // time of most recent motor request
+   boolean watchdogStopping;     // true while motors ramp to stop
+   boolean syncEnabled;        // synchronize wheels for moves with equal wheel speeds 
+   boolean syncActive;         // true while a synchronized move is running
+   int syncGain;
+   int syncDir[NBR_WHEELS];
+   int32_t syncTicks[NBR_WHEELS]; // ticks moved since the synchronized move started 
+   boolean poseEventsFlag;
+   Kinematics *kinematics;
+   irLineSensorClass *lineSensor;
+   boolean lineFollowActive;
+   int lineSpeed;              // mm per second
+   int lineKp;                 // degrees per second turn for each 1000 of line position
+   int lineKd;                 // degrees per second turn for each 1000 per 100ms change of line position
+   int prevLinePosition;
+   uint32_t lineSeenMillis;    // time the line was last seen
+   uint16_t commandCount;      // incremented by each motor command
  };
    
 
@@ -115,8 +243,25 @@ public:
    void begin(byte nbrElements, byte pinCount, const pinArray_t pins[]);
    void reset();
    void reportValue(int sequenceId, Stream * stream) ; // send the value of the given device
+   void tick(Stream *stream);  // acts on changes detected by the interrupt handlers
+   void setReflexMotors(robotMotorClass *motors); // needed for the reflex
+   void setReflex(int mode, int power, int ms);   // mode is a bumpReflex_t, power is percent
+   boolean isBumped(int sequenceId);
    void processRequestMsg(Stream *stream);
   // void reportName(Stream *stream);
+ private:
+   void startReflex(int sequenceId, Stream *stream);
+   robotMotorClass *motors;
+   byte reflexMode;
+   int reflexPower;
+   int reflexDuration;
+   boolean isBackingOff;
+   uint16_t reflexCommand;     // motor command count when the back off started
+   uint32_t reflexStartMillis;
+   byte prevState;             // bit for each sensor set when bumped
+   boolean changeEventsFlag;
+   boolean isEventPending;
+   uint32_t prevEventMillis;
 };
 
 class irLineSensorClass : public asipServiceClass
@@ -125,11 +270,36 @@ public:
    irLineSensorClass(const char svcId);
    void begin(byte nbrElements, byte pinCount, const pinArray_t pins[]);
    void reset();
-   int16_t getValue(int sequenceId);
+   int16_t getValue(int sequenceId);  // normalised value from the most recent sample 
    void reportValues(Stream *stream);
    void reportValue(int sequenceId, Stream * stream) ; // send the value of the given device
+   void tick(Stream *stream);
+   void startCalibration();
+   boolean endCalibration();   // false if the calibration could not be saved
+   void reportCalibration(Stream *stream);
+   boolean getLinePosition(int &position); // false if no sensor sees the line, position is then beyond the side last seen
+   void reportLinePosition(Stream *stream);
+   void setSampleInterval(int ms);  // ms between sweeps, 0 only sweeps when events or calibration need them
    void processRequestMsg(Stream *stream);
   // void reportName(Stream *stream);
+ private:
+   enum irPhase_t {IR_IDLE, IR_AMBIENT, IR_SETTLING, IR_LIT};
+   int sweepInterval();  // ms between sweeps, -1 if sampling is not needed
+   void startSweep();  
+   void serviceSweep();  // one step of the sweep for each call  
+   void completeSweep();
+   int readSensor(int sequenceId);
+   int16_t normalise(int sequenceId, int reading);
+   int16_t value[IR_MAX_SENSORS];  // results of the most recent complete sweep
+   int16_t sweep[IR_MAX_SENSORS];  // readings of the sweep in progress
+   byte phase;
+   byte channel;                   // sensor to be read next
+   uint32_t emitterOnMicros;
+   boolean isCalibrating;
+   boolean lineEventsFlag;
+   int lastPosition;           // most recent position where the line was seen
+   int sampleInterval;
+   uint32_t prevSampleMillis;
 };    
 
 
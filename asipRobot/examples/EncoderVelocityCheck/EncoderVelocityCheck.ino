@@ -0,0 +1,89 @@
+/*    
+ * Checks the wheel speed estimate against a simulated motor and encoder.
+ * 
+ * No robot is needed, the sketch runs on any board with a serial port.
+ * MotorSim is stepped in virtual time so the frames are exactly PID_FRAME_HZ apart
+ * and the results are the same on every board. For each PWM value the motor 
+ * is given time to reach a steady speed, then the EncoderVelocity estimate is 
+ * averaged over one second and compared with the speed of the simulated wheel. 
+ * The low PWM values turn the wheel by only a few ticks per frame, including 
+ * speeds below one tick per frame, where the estimate depends on the time 
+ * between encoder edges rather than the counts in each frame. 
+ */
+
+#include <MotorSim.h>
+#include <EncoderVelocity.h>
+#include <MotorPid.h>         // for PID_FRAME_HZ
+
+const int  testPwm[]      = {22, 23, 24, 25, 26, 28, 32, 40, 60, 100, 180, 255};
+const int  nbrTests       = sizeof(testPwm) / sizeof(testPwm[0]);
+const long settleMicros   = 2000000;  // time for the speed to become steady
+const long measureMicros  = 1000000;  // time the estimate is averaged over
+const float maxError      = 5.0;      // percent error allowed 
+
+MotorSim motor(defaultMotorSimParams);
+EncoderVelocity velocity;
+
+void setup()
+{
+  Serial.begin(57600);
+  while(!Serial)
+    ;
+  Serial.println("pwm, ticks per frame, actual ticks/sec, estimated ticks/sec, error %");
+  int failures = 0;
+  for(int i=0; i < nbrTests; i++) {
+    if( !checkSpeed(testPwm[i])) {
+      failures++;
+    }
+  }
+  Serial.print(failures == 0 ? "PASS" : "FAIL, tests failed: ");
+  if( failures > 0) {
+    Serial.print(failures);
+  }
+  Serial.println();
+}
+
+void loop()
+{
+}
+
+// returns true if the averaged estimate is within maxError percent of the simulated speed
+boolean checkSpeed(int pwm)
+{
+  const uint32_t frameMicros = 1000000L / PID_FRAME_HZ;
+  motor.reset();
+  motor.setPwm(pwm);
+  velocity.reset(0, 0);
+  float actualSum = 0;
+  float estimateSum = 0;
+  int frames = 0;
+  int32_t startPos = 0;
+  while( motor.getMicros() < settleMicros + measureMicros) {
+    motor.step(frameMicros);
+    int32_t estimate = velocity.update(motor.getPosition(), motor.getEdgeMicros(), motor.getMicros());
+    if( motor.getMicros() <= settleMicros) {
+      startPos = motor.getPosition();
+    }
+    else {
+      actualSum += motor.getWheelSpeed() * defaultMotorSimParams.ticksPerRev / (2 * PI);
+      estimateSum += (float)estimate / VELOCITY_SCALE;
+      frames++;
+    }
+  }
+  float actual = actualSum / frames;
+  float estimate = estimateSum / frames;
+  float ticksPerFrame = (float)(motor.getPosition() - startPos) / frames;
+  float error = actual > 0 ? 100 * (estimate - actual) / actual : 100;
+  boolean isPass = fabs(error) <= maxError;
+  Serial.print(pwm);
+  Serial.print(", ");
+  Serial.print(ticksPerFrame);
+  Serial.print(", ");
+  Serial.print(actual);
+  Serial.print(", ");
+  Serial.print(estimate);
+  Serial.print(", ");
+  Serial.print(error);
+  Serial.println(isPass ? "" : "  <- FAIL");
+  return isPass;
+}
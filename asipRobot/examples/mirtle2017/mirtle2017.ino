@@ -70,6 +70,7 @@ void setup()
   asip.reserve(SCL);  // these defines are in pins_arduino.h  
 #ifdef neoPixelPin  
   asipPixels.begin(neoPixelPin, &strip); 
+  asipPixels.setImmediateShow(true); // colors set by this sketch are shown at once, requests are still shown once each
 #endif  
   pixelFun();
   beginAsipComms();  
@@ -10,6 +10,7 @@
      (libraries preceeded with * are third party, install using library manager)
       asipRobot
       asipPixels
+      asipRules
       Encoder
       u8g2 or TFT_eSPI LCD library
       Adafruit_NeoPixel
@@ -51,6 +52,7 @@
 #include <asipLCD.h>                // LCD
 #include <services/asipDistance.h>  // ultrasonics distance sensor
 #include <services/asipServos.h>    // definitions for servo
+#include <asipRules.h>              // reflex rules evaluated on the robot
 
 
 #ifdef ASIP_DEBUG
@@ -74,6 +76,7 @@ asipLCDClass asipLCD(id_LCD_SERVICE, NO_EVENT);
 asipDistanceClass asipDistance(id_DISTANCE_SERVICE);
 asipToneClass asipTone(id_TONE_SERVICE, NO_EVENT);
 asipServoClass asipServo(id_SERVO_SERVICE, NO_EVENT);
+asipRulesClass asipRules(id_RULES_SERVICE);
 
 Servo myServos[1];  // create one servo object
 
@@ -88,6 +91,7 @@ asipService services[] = {
   &asipDistance,
   &asipServo,
   &asipTone,
+  &asipRules,
   &asipIO  // the core class for pin level I/O
 };
 
@@ -99,6 +103,7 @@ void setup() {
 
 #if defined neoPixelPin
   asipPixels.begin(neoPixelPin, &strip, setColorCallback );
+  asipPixels.setImmediateShow(true); // colors set by this sketch are shown at once, requests are still shown once each
   asipPixels.setPixelColor(0, 128 << 16); // red while starting up
 #else
   asipPixels.begin(setColorCallback); // pixel requests will be resolved on LCD
@@ -106,9 +111,15 @@ void setup() {
   beginAsipComms();
   motors.begin(2, 6, motorPins, 4, encoderPins);  // two motors,a total of 6 motor pins,4 encoder pins
   bumpSensors.begin(2, 2, bumpPins);
+  bumpSensors.setReflexMotors(&motors);  // enables the bump reflex, see tag_BUMP_REFLEX
   irLineSensors.begin(3, 4, irReflectancePins);  // 3 sensors plus control pin
+  motors.setLineSensor(&irLineSensors);  // enables line following on the robot
   // accelerometer.begin(3);
   asipTone.begin(tonePin);
+  asipRules.begin();
+  asipRules.setMotors(&motors);
+  asipRules.setSensors(&irLineSensors, &bumpSensors, &asipDistance);
+  asipRules.setOutputs(&asipTone, &asipPixels);
   asipServo.begin(1, servoPins, myServos);
 #ifdef ledPin
 #ifndef _PICO2040_  // do not use with pico w
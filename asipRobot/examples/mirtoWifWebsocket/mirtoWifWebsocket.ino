@@ -113,6 +113,7 @@ void setup() {
   
 #if defined neoPixelPin
   asipPixels.begin(neoPixelPin, &strip, setColorCallback );
+  asipPixels.setImmediateShow(true); // colors set by this sketch are shown at once, requests are still shown once each
   asipPixels.setPixelColor(0, 128 << 16); // red while starting up
 #else
   asipPixels.begin(setColorCallback); // pixel requests will be resolved on LCD
@@ -87,6 +87,8 @@ Servo myServos[1];  // create one servo object
 
 #include "tunes.h" // for melody player
 PlayMelody player(tonePin);  // just for some music while connecting to WiFi
+// the same tunes can be played by the host with T,S,index,tempo
+const int16_t *tuneScores[] = {starwars, ode_to_joy, lullaby, mario_bros, game_over, prince_igor};
 
 // make a list of the created services
 asipService services[] = {
@@ -110,6 +112,7 @@ void setup() {
   
 #if defined neoPixelPin
   asipPixels.begin(neoPixelPin, &strip, setColorCallback );
+  asipPixels.setImmediateShow(true); // colors set by this sketch are shown at once, requests are still shown once each
   asipPixels.setPixelColor(0, 128 << 16); // red while starting up
 #else
   asipPixels.begin(setColorCallback); // pixel requests will be resolved on LCD
@@ -124,6 +127,7 @@ void setup() {
   irLineSensors.begin(3, 4, irReflectancePins);  // 3 sensors plus control pin
   // accelerometer.begin(3);
   asipTone.begin(tonePin);
+  asipTone.setScores(tuneScores, sizeof(tuneScores) / sizeof(tuneScores[0]));
   asipServo.begin(1,servoPins,myServos);  
 #ifdef ledPin
   #ifndef _PICO2040_  // do not use with pico w
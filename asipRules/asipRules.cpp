@@ -0,0 +1,273 @@
+/*
+ * asipRules.cpp -  Arduino Services Interface Protocol (ASIP)
+ *
+ * Rules are edge triggered: a rule fires when its condition becomes true
+ * and is armed again when the condition is false.
+ *
+ * Copyright (C) 2024 Michael Margolis
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include "asipRules.h"
+#include "asipRobot.h"
+#include "services/asipTone.h"
+
+// the pixel action is only available if the sketch also uses the asipPixels library
+#if defined(__has_include)
+#if __has_include("asipPixels.h")
+#include "asipPixels.h"
+#define RULES_HAS_PIXELS
+#endif
+#endif
+#include "services/asipDistance.h"
+
+asipRulesClass::asipRulesClass(const char svcId) : asipServiceClass(svcId)
+{
+   svcName = PSTR("Rules");
+   motors = NULL;
+   irSensors = NULL;
+   bumpSensors = NULL;
+   distance = NULL;
+   tone = NULL;
+   pixels = NULL;
+}
+
+void asipRulesClass::begin()
+{
+   asipServiceClass::begin(MAX_RULES, 0, NULL);
+   clearRules();
+}
+
+void asipRulesClass::setMotors(robotMotorClass *motors)
+{
+   this->motors = motors;
+}
+
+void asipRulesClass::setSensors(irLineSensorClass *irSensors, bumpSensorClass *bumpSensors, asipDistanceClass *distance)
+{
+   this->irSensors = irSensors;
+   this->bumpSensors = bumpSensors;
+   this->distance = distance;
+}
+
+void asipRulesClass::setOutputs(asipToneClass *tone, asipPixelsClass *pixels)
+{
+   this->tone = tone;
+   this->pixels = pixels;
+}
+
+void asipRulesClass::reset()
+{
+   clearRules();
+}
+
+void asipRulesClass::reportValue(int sequenceId, Stream * stream)
+{
+}
+
+void asipRulesClass::clearRules()
+{
+   for(byte i=0; i < MAX_RULES; i++) {
+      deleteRule(i);
+   }
+}
+
+void asipRulesClass::deleteRule(byte rule)
+{
+   if( rule < MAX_RULES) {
+      rules[rule].source = RULE_UNUSED;
+      rules[rule].isTriggered = false;
+   }
+}
+
+// returns true if the services needed by the source and action have been given to this service
+bool asipRulesClass::isAvailable(byte source, byte action)
+{
+   switch(source) {
+      case RULE_IR:       if( irSensors == NULL) return false; break;
+      case RULE_BUMP:     if( bumpSensors == NULL) return false; break;
+      case RULE_DISTANCE: if( distance == NULL) return false; break;
+      case RULE_ANALOG:   break;
+      case RULE_ENCODER:  if( motors == NULL) return false; break;
+      default: return false;
+   }
+   switch(action) {
+      case RULE_REPORT: return true;
+      case RULE_STOP:
+      case RULE_POWER:  return motors != NULL;
+#ifdef RULES_HAS_PIXELS
+      case RULE_PIXEL:  return pixels != NULL;
+#endif
+      case RULE_TONE:   return tone != NULL;
+   }
+   return false;
+}
+
+bool asipRulesClass::setRule(byte rule, byte source, byte index, byte compare, int threshold, byte action, int32_t arg1, int32_t arg2)
+{
+   if( rule >= MAX_RULES || !isAvailable(source, action)) {
+      return false;
+   }
+   if( source == RULE_ANALOG && !IS_PIN_ANALOG(index)) {
+      return false;  // analogRead could reconfigure a pin used by another service
+   }
+   rule_t &r = rules[rule];
+   r.source = RULE_UNUSED;  // not evaluated until complete
+   r.index = index;
+   r.compare = compare == RULE_ABOVE ? RULE_ABOVE : RULE_BELOW;
+   r.threshold = threshold;
+   r.action = action;
+   r.arg1 = arg1;
+   r.arg2 = arg2;
+   r.value = 0;
+   r.isTriggered = false;
+   if( source == RULE_ANALOG) {
+#if defined(TARGET_RP2040) || defined(TARGET_RASPBERRY_PI_PICO)
+#else
+      r.index = PIN_TO_ANALOG(index); // convert digital number to analog
+#endif
+      r.value = analogRead(r.index);
+   }
+   r.source = source;
+   return true;
+}
+
+bool asipRulesClass::readSource(rule_t &r, bool isAnalogDue)
+{
+   bool isValid = true;
+   switch(r.source) {
+      case RULE_IR:       r.value = irSensors->getValue(r.index); break;
+      case RULE_BUMP:     r.value = bumpSensors->isBumped(r.index) ? 1 : 0; break;
+      case RULE_DISTANCE: r.value = distance->getFilteredDistance(r.index, isValid); break;
+      case RULE_ANALOG:
+         if( isAnalogDue) {
+            r.value = analogRead(r.index);
+         }
+         break;
+      case RULE_ENCODER:  r.value = motors->getWheelRPM(r.index); break;
+      default: return false;
+   }
+   return isValid;
+}
+
+void asipRulesClass::tick(Stream *stream)
+{
+   bool isAnalogDue = millis() - prevAnalogMillis >= RULE_ANALOG_INTERVAL;
+   if( isAnalogDue) {
+      prevAnalogMillis = millis();
+   }
+   for(byte i=0; i < MAX_RULES; i++) {
+      rule_t &r = rules[i];
+      if( r.source == RULE_UNUSED || !readSource(r, isAnalogDue)) {
+         continue;
+      }
+      bool isTrue = r.compare == RULE_ABOVE ? r.value > r.threshold : r.value < r.threshold;
+      if( isTrue && !r.isTriggered) {
+         fire(i, stream);
+      }
+      r.isTriggered = isTrue;
+   }
+}
+
+// the action is performed before the event is sent
+void asipRulesClass::fire(byte rule, Stream *stream)
+{
+   rule_t &r = rules[rule];
+   switch(r.action) {
+      case RULE_STOP:
+         motors->stopMotors();
+         break;
+      case RULE_POWER:
+         {
+            int power[NBR_WHEELS];
+            for(int i=0; i < NBR_WHEELS; i++) {
+               power[i] = i % 2 == 0 ? r.arg1 : r.arg2;  // even wheels are on the left
+            }
+            motors->setMotorPowers(power);
+         }
+         break;
+#ifdef RULES_HAS_PIXELS
+      case RULE_PIXEL:
+         pixels->setPixelColor(r.arg1, (uint32_t)r.arg2);
+         break;
+#endif
+      case RULE_TONE:
+         tone->queueNote(r.arg1, r.arg2);
+         break;
+   }
+   stream->write(EVENT_HEADER);
+   stream->write(ServiceId);
+   stream->write(',');
+   stream->write(tag_RULE_FIRED);
+   stream->write(',');
+   stream->print(rule);
+   stream->write(',');
+   stream->print(r.value);
+   stream->write(MSG_TERMINATOR);
+}
+
+void asipRulesClass::reportRule(byte rule, Stream *stream)
+{
+   if( rule >= MAX_RULES) {
+      reportError(ServiceId, tag_GET_RULE, ERR_INVALID_DEVICE_NUMBER, stream);
+      return;
+   }
+   rule_t &r = rules[rule];
+   stream->write(EVENT_HEADER);
+   stream->write(ServiceId);
+   stream->write(',');
+   stream->write(tag_RULE_EVENT);
+   stream->write(',');
+   stream->print(rule);
+   stream->write(',');
+   stream->print(r.source);
+   stream->write(',');
+   stream->print(r.index);
+   stream->write(',');
+   stream->print(r.compare);
+   stream->write(',');
+   stream->print(r.threshold);
+   stream->write(',');
+   stream->print(r.action);
+   stream->write(',');
+   stream->print(r.arg1);
+   stream->write(',');
+   stream->print(r.arg2);
+   stream->write(MSG_TERMINATOR);
+}
+
+void asipRulesClass::processRequestMsg(Stream *stream)
+{
+   int request = stream->read();
+   switch(request) {
+      case tag_SET_RULE:
+         {
+            // arguments are read in order before the rule is set
+            byte rule      = stream->parseInt();
+            byte source    = stream->parseInt();
+            byte index     = stream->parseInt();
+            byte compare   = stream->parseInt();
+            int  threshold = stream->parseInt();
+            byte action    = stream->parseInt();
+            int32_t arg1   = stream->parseInt();
+            int32_t arg2   = stream->parseInt();
+            if( rule >= MAX_RULES) {
+               reportError(ServiceId, request, ERR_INVALID_DEVICE_NUMBER, stream);
+            }
+            else if( source == RULE_ANALOG && !IS_PIN_ANALOG(index)) {
+               reportError(ServiceId, request, ERR_INVALID_PIN, stream);
+            }
+            else if( !setRule(rule, source, index, compare, threshold, action, arg1, arg2)) {
+               reportError(ServiceId, request, ERR_DEVICE_NOT_AVAILABLE, stream);
+            }
+         }
+         break;
+      case tag_DELETE_RULE: deleteRule(stream->parseInt()); break;
+      case tag_CLEAR_RULES: clearRules(); break;
+      case tag_GET_RULE: reportRule(stream->parseInt(), stream); break;
+      default: reportError(ServiceId, request, ERR_UNKNOWN_REQUEST, stream);
+   }
+}
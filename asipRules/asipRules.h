@@ -0,0 +1,116 @@
+/*
+ * asipRules.h -  Reflex rules service for Arduino Services Interface Protocol (ASIP)
+ *
+ * A small table of rules uploaded by the host, each of the form
+ * "if a sensor value crosses a threshold, perform an action".
+ * Rules are evaluated on every pass of asip.service() using values already
+ * cached by the other services, so simple behaviours such as cliff detection
+ * or slowing near obstacles run without a host round trip.
+ *
+ * This service depends on the asipRobot library. The pixel action needs the 
+ * asipPixels library and is only available when the sketch includes asipPixels.h.
+ *
+ * Copyright (C) 2024 Michael Margolis
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef asipRules_h
+#define asipRules_h
+
+#include "asip.h"
+
+// Service and method defines
+// Service IDs must be unique across all services
+// Method and event IDs must be unique within a service
+
+// ID used:  ABCDEGHILMNPRSTX
+
+// Rules service
+const char id_RULES_SERVICE = 'X';
+// methods
+const char tag_SET_RULE    = 'R';  // X,R,rule,source,index,compare,threshold,action,arg1,arg2
+const char tag_DELETE_RULE = 'D';  // X,D,rule
+const char tag_CLEAR_RULES = 'C';  // delete all rules
+const char tag_GET_RULE    = 'G';  // X,G,rule  replies with a rule event
+// events
+const char tag_RULE_EVENT  = 'r';  // @X,r,rule,source,index,compare,threshold,action,arg1,arg2
+const char tag_RULE_FIRED  = 'f';  // @X,f,rule,value  sent when a rule's condition becomes true
+
+// values a rule can test, index selects the sensor, pin or wheel
+enum ruleSource_t {
+   RULE_UNUSED,     // the rule is empty
+   RULE_IR,         // IR line sensor value, 0 to 1000
+   RULE_BUMP,       // 1 if the bump switch is closed
+   RULE_DISTANCE,   // distance in cm
+   RULE_ANALOG,     // analogRead of the given analog capable pin, sampled every RULE_ANALOG_INTERVAL ms
+   RULE_ENCODER     // wheel speed in rpm
+};
+
+enum ruleCompare_t {RULE_BELOW, RULE_ABOVE};  // value < threshold, value > threshold
+
+// actions use the methods of the other services
+enum ruleAction_t {
+   RULE_REPORT,     // only send the fired event
+   RULE_STOP,       // stop the motors
+   RULE_POWER,      // set the power of the left wheels to arg1 and the right wheels to arg2 (percent)
+   RULE_PIXEL,      // set pixel arg1 to the 32 bit color arg2
+   RULE_TONE        // play a tone of arg1 Hz for arg2 ms
+};
+
+const byte MAX_RULES            = 8;
+const int  RULE_ANALOG_INTERVAL = 10;   // ms between analog reads for analog rules
+
+typedef struct {
+   byte source;        // ruleSource_t
+   byte index;
+   byte compare;       // ruleCompare_t
+   byte action;        // ruleAction_t
+   int16_t threshold;
+   int32_t arg1;
+   int32_t arg2;
+   int16_t value;      // most recent value of the source
+   bool isTriggered;   // true while the condition holds, the rule fires again after it clears
+} rule_t;
+
+class robotMotorClass;
+class irLineSensorClass;
+class bumpSensorClass;
+class asipDistanceClass;
+class asipToneClass;
+class asipPixelsClass;
+
+class asipRulesClass : public asipServiceClass
+{
+public:
+   asipRulesClass(const char svcId);
+   void begin();
+   // the services rules can read from and act on, any can be NULL
+   void setMotors(robotMotorClass *motors);
+   void setSensors(irLineSensorClass *irSensors, bumpSensorClass *bumpSensors, asipDistanceClass *distance);
+   void setOutputs(asipToneClass *tone, asipPixelsClass *pixels);
+   void reset();
+   void reportValue(int sequenceId, Stream * stream) ; // not used in this service
+   void processRequestMsg(Stream *stream);
+   void tick(Stream *stream);
+   bool setRule(byte rule, byte source, byte index, byte compare, int threshold, byte action, int32_t arg1, int32_t arg2);
+   void deleteRule(byte rule);
+   void clearRules();
+   void reportRule(byte rule, Stream *stream);
+private:
+   bool readSource(rule_t &r, bool isAnalogDue); // false if the source is not available
+   bool isAvailable(byte source, byte action);
+   void fire(byte rule, Stream *stream);
+   rule_t rules[MAX_RULES];
+   uint32_t prevAnalogMillis;
+   robotMotorClass *motors;
+   irLineSensorClass *irSensors;
+   bumpSensorClass *bumpSensors;
+   asipDistanceClass *distance;
+   asipToneClass *tone;
+   asipPixelsClass *pixels;
+};
+
+#endif